@@ -0,0 +1,351 @@
+// Emstrument send pipeline benchmark
+// Build and run with "make runbench". Drives the module's internals directly (queueing, the
+// dedup passes in MIDI.sendmessages(), note off scheduling, resetting notes) with synthetic
+// workloads on the null backend, and reports the time per event and the number of
+// allocations the module made per frame. Steady-state frames shouldn't allocate anything: the
+// benchmark exits with status 1 if any of them did (after the warmup frames).
+
+#define _GNU_SOURCE // emstrument.c needs it, and it has to come before any system header
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+// Count the module's allocations (emstrument.c is included below, so the macros only apply to it)
+static uint64_t allocations = 0;
+
+static void *countedMalloc(size_t size)
+{
+    allocations++;
+    return malloc(size);
+}
+
+static void *countedRealloc(void *pointer, size_t size)
+{
+    allocations++;
+    return realloc(pointer, size);
+}
+
+#define malloc countedMalloc
+#define realloc countedRealloc
+#include "../emstrument.c"
+#undef malloc
+#undef realloc
+
+// Everything runs on the default context, the one MIDI.init() sets up
+static emstContext *const ctx = &defaultContext;
+
+#define WARMUP_FRAMES 100
+#define FRAMES 2000
+
+typedef struct {
+    const char *name;
+    int eventsPerFrame;
+    void (*setup)(lua_State *L); // optional, runs once before the warmup frames
+    void (*prepare)(lua_State *L, int frame); // optional, runs before each frame, not timed
+    void (*frame)(lua_State *L, int frame); // timed
+} workload;
+
+// Same as MIDI.sendmessages(), without the Lua call (midi_sendMessages() can only be called
+// from Lua, since it looks at its upvalues to find its context)
+static void flush(lua_State *L)
+{
+    sendMessages(ctx);
+}
+
+// Tetris-style burst: a line clear plays a run of notes with durations on 4 channels,
+// retriggers some notes that are still playing, and moves a few controllers.
+#define TETRIS_NOTES 10
+static void tetrisFrame(lua_State *L, int frame)
+{
+    for (int ch = 0; ch < 4; ch++) {
+        for (int i = 0; i < TETRIS_NOTES; i++) {
+            int note = 36 + ((frame * 7 + ch * 12 + i * 5) % 60);
+            queueCommand(ctx, L, makeCommand(kNoteOnWithDuration, ch, note, 100, 8));
+        }
+        queueCommand(ctx, L, makeCommand(kNoteOn, ch, 36 + ((frame * 7 + ch * 12) % 60), 90, 0));
+        queueCommand(ctx, L, makeCommand(kCC, ch, 1, frame & 0x7F, 0));
+        queueCommand(ctx, L, makeCommand(kCC, ch, 7, (frame / 2) & 0x7F, 0));
+    }
+    flush(L);
+}
+
+// CC sweep: 32 controllers on every channel, each set 4 times per frame (only the last one
+// survives the dedup pass), with values that change every frame.
+static void ccSweepFrame(lua_State *L, int frame)
+{
+    for (int repeat = 0; repeat < 4; repeat++) {
+        for (int ch = 0; ch < 16; ch++) {
+            for (int cc = 0; cc < 32; cc++) {
+                queueCommand(ctx, L, makeCommand(kCC, ch, cc, (frame + cc + repeat) & 0x7F, 0));
+            }
+        }
+    }
+    flush(L);
+}
+
+// Panic with every note playing on all 16 channels. Only the panic flush is timed.
+static void panicPrepare(lua_State *L, int frame)
+{
+    for (int ch = 0; ch < 16; ch++) {
+        for (int note = 0; note < 128; note++) {
+            queueCommand(ctx, L, makeCommand(kNoteOn, ch, note, 100, 0));
+        }
+    }
+    flush(L);
+}
+
+static void panicFrame(lua_State *L, int frame)
+{
+    queueCommand(ctx, L, makeCommand(kResetAllNotes, 0, 0, 0, 0));
+    flush(L);
+}
+
+// Resetting the same sets of playing notes with sendResetAllNotes() (what MIDI.panic() does,
+// using the per-channel playing note bits), and with the per-note scan it replaced, which looked
+// at a bool for every note of every channel. Only the reset is timed.
+static bool (*resetNoteSet)(int ch, int note);
+static bool notePlaying[16][128]; // the scan's state
+
+static bool everyNote(int ch, int note)
+{
+    return true;
+}
+
+static bool chordOnEveryChannel(int ch, int note)
+{
+    return (note == 60) || (note == 64) || (note == 67) || (note == 71);
+}
+
+static bool chordOnOneChannel(int ch, int note)
+{
+    return (ch == 0) && chordOnEveryChannel(ch, note);
+}
+
+static void everyNoteSetup(lua_State *L)
+{
+    resetNoteSet = everyNote;
+}
+
+static void chordOnEveryChannelSetup(lua_State *L)
+{
+    resetNoteSet = chordOnEveryChannel;
+}
+
+static void chordOnOneChannelSetup(lua_State *L)
+{
+    resetNoteSet = chordOnOneChannel;
+}
+
+static void resetPrepare(lua_State *L, int frame)
+{
+    for (int ch = 0; ch < 16; ch++) {
+        for (int note = 0; note < 128; note++) {
+            if (resetNoteSet(ch, note)) {
+                queueCommand(ctx, L, makeCommand(kNoteOn, ch, note, 100, 0));
+            }
+        }
+    }
+    flush(L);
+}
+
+static void resetFrame(lua_State *L, int frame)
+{
+    batchBegin(&ctx->flushBatch);
+    sendResetAllNotes(&ctx->flushBatch);
+    batchSubmit(&ctx->flushBatch);
+}
+
+static void scanPrepare(lua_State *L, int frame)
+{
+    for (int ch = 0; ch < 16; ch++) {
+        for (int note = 0; note < 128; note++) {
+            notePlaying[ch][note] = resetNoteSet(ch, note);
+        }
+    }
+}
+
+static void scanFrame(lua_State *L, int frame)
+{
+    batchBegin(&ctx->flushBatch);
+    for (int ch = 0; ch < 16; ch++) {
+        for (int note = 0; note < 128; note++) {
+            if (notePlaying[ch][note]) {
+                notePlaying[ch][note] = false;
+                batchAdd(&ctx->flushBatch, 0x80, ch, note, 0);
+                cancelNoteOff(ctx, ch, note);
+            }
+        }
+    }
+    batchSubmit(&ctx->flushBatch);
+}
+
+// Scheduling and cancelling note offs (far enough in the future that they never go out)
+static void scheduleFrame(lua_State *L, int frame)
+{
+    uint64_t time = schedulerNowNs(ctx) + 60000000000ull;
+    for (int ch = 0; ch < 16; ch++) {
+        for (int note = 0; note < 128; note++) {
+            scheduleNoteOff(ctx, ch, note, frame, time);
+        }
+    }
+    for (int ch = 0; ch < 16; ch++) {
+        for (int note = 0; note < 128; note++) {
+            cancelNoteOff(ctx, ch, note);
+        }
+    }
+}
+
+// 1000 note ons queued by a Lua script through the per-call API, and the same through
+// MIDI.queue(). Only queueing is timed, the last frame's commands are flushed before each frame.
+#define API_EVENTS 1000
+
+static const char *kPerCallScript =
+    "for ch = 1, 8 do\n"
+    "    for note = 0, 124 do\n"
+    "        MIDI.noteon(note, 100, ch)\n"
+    "    end\n"
+    "end\n";
+
+static const char *kQueueSetupScript =
+    "local events = {}\n"
+    "for ch = 0, 7 do\n"
+    "    for note = 0, 124 do\n"
+    "        events[#events + 1] = string.char(MIDI.NOTEON, ch, note, 100, 0, 0)\n"
+    "    end\n"
+    "end\n"
+    "benchEvents = table.concat(events)\n";
+
+static const char *kQueueScript = "MIDI.queue(benchEvents)\n";
+
+static void runScript(lua_State *L, const char *name)
+{
+    lua_getfield(L, LUA_REGISTRYINDEX, name);
+    if (lua_pcall(L, 0, 0, 0) != 0) {
+        fprintf(stderr, "%s\n", lua_tostring(L, -1));
+        exit(1);
+    }
+}
+
+// Compiles script and keeps it in the registry under name
+static void loadScript(lua_State *L, const char *name, const char *script)
+{
+    if (luaL_loadstring(L, script) != 0) {
+        fprintf(stderr, "%s\n", lua_tostring(L, -1));
+        exit(1);
+    }
+    lua_setfield(L, LUA_REGISTRYINDEX, name);
+}
+
+static void perCallSetup(lua_State *L)
+{
+    loadScript(L, "benchPerCall", kPerCallScript);
+}
+
+static void queueSetup(lua_State *L)
+{
+    loadScript(L, "benchQueueSetup", kQueueSetupScript);
+    runScript(L, "benchQueueSetup");
+    loadScript(L, "benchQueue", kQueueScript);
+}
+
+static void flushPrepare(lua_State *L, int frame)
+{
+    flush(L);
+}
+
+static void perCallFrame(lua_State *L, int frame)
+{
+    runScript(L, "benchPerCall");
+}
+
+static void queueFrame(lua_State *L, int frame)
+{
+    runScript(L, "benchQueue");
+}
+
+static const workload kWorkloads[] = {
+    {"tetris burst (queue + flush)", 4 * (TETRIS_NOTES + 3), NULL, NULL, tetrisFrame},
+    {"CC sweep, 16 channels", 4 * 16 * 32, NULL, NULL, ccSweepFrame},
+    {"panic, 16x128 notes playing", 16 * 128, NULL, panicPrepare, panicFrame},
+    {"reset 16x128 playing, bitsets", 16 * 128, everyNoteSetup, resetPrepare, resetFrame},
+    {"reset 16x128 playing, bool scan", 16 * 128, everyNoteSetup, scanPrepare, scanFrame},
+    {"reset 16 chords playing, bitsets", 16 * 4, chordOnEveryChannelSetup, resetPrepare, resetFrame},
+    {"reset 16 chords playing, bool scan", 16 * 4, chordOnEveryChannelSetup, scanPrepare, scanFrame},
+    {"reset 1 chord playing, bitsets", 4, chordOnOneChannelSetup, resetPrepare, resetFrame},
+    {"reset 1 chord playing, bool scan", 4, chordOnOneChannelSetup, scanPrepare, scanFrame},
+    {"schedule + cancel note offs", 2 * 16 * 128, NULL, NULL, scheduleFrame},
+    {"queue 1000 note ons, per-call API", API_EVENTS, perCallSetup, flushPrepare, perCallFrame},
+    {"queue 1000 note ons, MIDI.queue()", API_EVENTS, queueSetup, flushPrepare, queueFrame},
+    {NULL, 0, NULL, NULL, NULL}
+};
+
+// Returns false if any frame after the warmup allocated memory
+static bool runWorkload(lua_State *L, const workload *w)
+{
+    // start every workload from a clean slate
+    queueCommand(ctx, L, makeCommand(kResetAllNotes, 0, 0, 0, 0));
+    flush(L);
+
+    if (w->setup) {
+        w->setup(L);
+    }
+    for (int frame = 0; frame < WARMUP_FRAMES; frame++) {
+        if (w->prepare) {
+            w->prepare(L, frame);
+        }
+        w->frame(L, frame);
+    }
+
+    uint64_t time = 0;
+    uint64_t frameAllocations = 0;
+    int allocatingFrames = 0;
+    for (int frame = WARMUP_FRAMES; frame < WARMUP_FRAMES + FRAMES; frame++) {
+        if (w->prepare) {
+            w->prepare(L, frame);
+        }
+        uint64_t allocationsBefore = allocations;
+        uint64_t start = currentTimeNs();
+        w->frame(L, frame);
+        time += currentTimeNs() - start;
+        frameAllocations += allocations - allocationsBefore;
+        if (allocations != allocationsBefore) {
+            allocatingFrames++;
+        }
+    }
+
+    double nsPerEvent = (double)time / ((double)FRAMES * w->eventsPerFrame);
+    printf("%-34s %8d %10.1f %10.1f %14.2f\n", w->name, w->eventsPerFrame, nsPerEvent,
+           (double)time / FRAMES / 1000.0, (double)frameAllocations / FRAMES);
+    if (allocatingFrames > 0) {
+        fprintf(stderr, "%s: %d of %d steady-state frames allocated memory\n", w->name, allocatingFrames, FRAMES);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    lua_State *L = luaL_newstate();
+    luaL_openlibs(L); // the setup scripts use the string library
+    luaopen_emstrument(L);
+    lua_settop(L, 0);
+
+    lua_pushcfunction(L, midi_init);
+    lua_pushstring(L, "null");
+    if (lua_pcall(L, 1, 0, 0) != 0) {
+        fprintf(stderr, "%s\n", lua_tostring(L, -1));
+        return 1;
+    }
+    lua_settop(L, 0);
+
+    printf("%-34s %8s %10s %10s %14s\n", "workload", "events", "ns/event", "us/frame", "allocs/frame");
+    bool ok = true;
+    for (int i = 0; kWorkloads[i].name != NULL; i++) {
+        if (!runWorkload(L, &kWorkloads[i])) {
+            ok = false;
+        }
+    }
+
+    lua_close(L);
+    return ok ? 0 : 1;
+}
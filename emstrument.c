@@ -1,788 +1,4615 @@
 // Emstrument LUA module
+// Build with "make" (see the Makefile for options), or with one of these commands.
 // OS X build command (requires lua5.1 installation, change paths as necessary):
 // gcc -bundle -flat_namespace -undefined suppress -o emstrument.so emstrument.c -I/usr/include/liblua5.1 -llua5.1 -framework CoreMIDI
+// Linux build command (requires lua5.1 and ALSA development packages, add -DEMSTRUMENT_NO_ALSA
+// to build without ALSA, leaving only the ring buffer, shared memory and null backends):
+// gcc -shared -fPIC -pthread -o emstrument.so emstrument.c -I/usr/include/lua5.1 -lasound -ldl -lrt
 
+#define _GNU_SOURCE // for dladdr() and pthread_setaffinity_np()
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <lua.h>
 #include <lauxlib.h>
 #include <lualib.h>
+#include "emstrument_shm.h"
+#ifdef __APPLE__
+#include <mach/mach_time.h>
+#include <mach/thread_policy.h>
 #include <CoreMIDI/CoreMIDI.h>
+#endif
+#if defined(__linux__) && !defined(EMSTRUMENT_NO_ALSA)
+#define EMSTRUMENT_ALSA
+#include <alsa/asoundlib.h>
+#endif
 
 // These functions actually send the MIDI messages, functions beginning with midi_ queue the messages
 // which are processed and sent in midi_sendMessages()
-static void sendNoteOn(int ch, int note, int vel);
-static void sendNoteOnWithDuration(int ch, int note, int vel, int duration, float offset);
-static void sendNoteOff(int ch, int note);
-static void sendCC(int ch, int CC, int value);
-static void sendPitchBend(int ch, int msb, int lsb);
-static void sendResetNotes(int ch);
+// Messages are added to a messageBatch and handed to the transport backend all at once by batchSubmit().
 
-// defines how long '1' is for duration arguments
-#define DEFAULT_DURATION_UNIT 16; // roughly 1/60sec by default (in ms)
-// defines how long to wait between sending a note off and a note on message for the same note
-#define DEFAULT_OFFSET 0 // off by default, can be enabled if users are having timestamp issues
-
-static double duration_unit = DEFAULT_DURATION_UNIT;
-static double late_note_offset = DEFAULT_OFFSET;
+// C API: the same calls as the Lua API, exported with plain C types so that LuaJIT scripts can
+// call them through the FFI (see emstrument_ffi.lua) without going through the Lua stack.
+// Channels are 1-16 (17-32 for the second port etc.) like in the Lua API. Every function returns
+// EMST_OK (or, for emst_flush(), the number of batches sent), or one of the negative EMST_ errors,
+// and only queues anything if it succeeds. Like the Lua API, they must only be called from the thread running the script.
+// They work on the default context, the one the MIDI.* functions use.
+#define EMST_OK 0
+#define EMST_NOT_INITIALIZED -1 // MIDI.init() hasn't been called
+#define EMST_QUEUE_FULL -2 // not enough memory to queue the command
+int emst_noteon(int ch, int note, int vel);
+int emst_noteoff(int ch, int note);
+int emst_noteonwithduration(int ch, int note, int vel, int duration);
+int emst_cc(int ch, int cc, int value);
+int emst_pitchbend(int ch, double bend);
+int emst_allnotesoff(int ch);
+int emst_panic(void);
+int emst_flush(void);
 
-// For anyone interested in porting Emstrument, these pointers need to be modified to use 
-// different libraries than GCD and CoreMIDI.
-static MIDIClientRef luaMIDIClient = 0; // these are typedef-ed UInt32s rather than pointers
-static MIDIEndpointRef luaMIDIEndpoint = 0;
-static dispatch_queue_t luaMIDIQueue = NULL;
-
-// Keep track of whether a note is playing (128 notes on 16 channels)
-static bool notePlaying[16][128];
-
-// Keep track of the last note played for each note on each channel so we can 'cancel'
-// the timed note-off event if a the same note has been played again since then.
-// Note: As a uint8_t, this will fail if a note is played with a duration, and the same note is 
-// played exactly a multiple of 256 times between then and the end of its duration.
-// Can be avoided to some extent by using a larger-sized uint data type
-static uint8_t lastNoteIDs[16][128];
+// All of an instance's state (its endpoint, queue, notes, note scheduler and threads) is kept in
+// an emstContext, defined below once all of its parts are, so several instances can run in the
+// same process, e.g. one per emulator. See MIDI.open().
+typedef struct emstContext emstContext;
 
 typedef enum  {
-    kInvalid = -1,
     kNoteOn,
     kNoteOnWithDuration,
     kNoteOff,
     kCC,
     kPitchBend,
-    kResetNotes
+    kResetNotes,
+    kResetAllNotes,
+    kInvalid = 0xF // largest value that fits in a command's type field
 } commandType;
 
-typedef struct {
-    commandType type;
-    int channel;
-    // using unions for fake polymorphism
-    union {
-        int note;       // for note commands: note
-        int CC;         // for CC commands: CC
-        int MS7b;       // for pitch bend commands: most significant 7 bits
-    };
-    union {
-        int velocity;   // for note on commands: velocity
-        int value;      // for CC commands: value
-        int LS7b;       // for pitch bend commands: least significant 7 bits
-    };
-    union {
-        int duration;   // duration for note on with duration
-    };
-} command;
-
-static command *commandQueue = NULL; // Lua API calls add commands to queue.
-static uint32_t commandQueueAllocatedSize; // keep track of queue's dynamically allocated size.
-static int commandQueueIndex; // points to first free entry in commandQueue.
-#define CMD_BLOCK 64 // default size of queue and queue expansions
-
-// Adds command, expanding commandQueue if necessary
-static void queueCommand(command c) {
-    if (commandQueueIndex == commandQueueAllocatedSize) {
-        // expand
-        commandQueueAllocatedSize += CMD_BLOCK;
-        commandQueue = realloc(commandQueue, commandQueueAllocatedSize * sizeof(command));
-    }
-    commandQueue[commandQueueIndex] = c;
-    commandQueueIndex++;
+// Output ports: each context can have several endpoints (virtual sources/ports) of 16 channels
+// each, see MIDI.init(). Inside Emstrument a channel is addressed as port * 16 + MIDI channel, so
+// ports just extend the channel numbers: channel 17 (index 16) is the first channel of the
+// second port. The port only matters when messages are handed to the backend.
+#define MAX_PORTS 16
+#define CHANNEL_PORT(ch) ((ch) >> 4)
+#define CHANNEL_MIDI(ch) ((ch) & 0xF) // the channel in the port's MIDI messages
+
+// Commands are packed into 64 bits, so the queue and the passes over it in midi_sendMessages()
+// touch as little memory as possible:
+// bits 0-3: type, bits 4-7: MIDI channel, bits 8-14: data1, bits 15-21: data2, bits 22-25: port,
+// bits 26-31: unused, bits 32-63: duration (for note on with duration).
+// data1 is the note (note commands), CC (CC commands) or most significant 7 bits (pitch bend).
+// data2 is the velocity (note on commands), value (CC commands) or least significant 7 bits (pitch bend).
+typedef uint64_t command;
+
+static inline command makeCommand(commandType type, int ch, int data1, int data2, uint32_t duration)
+{
+    return ((uint64_t)(type & 0xF)) | ((uint64_t)CHANNEL_MIDI(ch) << 4) | ((uint64_t)(data1 & 0x7F) << 8) |
+        ((uint64_t)(data2 & 0x7F) << 15) | ((uint64_t)(CHANNEL_PORT(ch) & 0xF) << 22) | ((uint64_t)duration << 32);
 }
 
-// Called in various functions to make sure everything is in place.
-// For anyone interested in porting Emstrument, this function needs to be modified accordingly.
-static inline bool initcheck() {
-    return (luaMIDIClient && luaMIDIEndpoint && luaMIDIQueue && commandQueue);
+static inline commandType cmdType(command c) { return (commandType)(c & 0xF); }
+static inline int cmdChannel(command c) { return ((c >> 4) & 0xF) | ((c >> 18) & 0xF0); } // port * 16 + channel
+static inline int cmdData1(command c) { return (c >> 8) & 0x7F; }
+static inline int cmdData2(command c) { return (c >> 15) & 0x7F; }
+static inline uint32_t cmdDuration(command c) { return (uint32_t)(c >> 32); }
+
+static inline command cmdWithType(command c, commandType type)
+{
+    return (c & ~(uint64_t)0xF) | (uint64_t)(type & 0xF);
 }
 
-/******** API calls ********/
+#define CMD_BLOCK 64 // initial size of queue, doubled whenever more commands are queued than capacity
+#define CMD_MAX (1 << 24) // queue never grows past this many commands
 
-// MIDI.init()
-// No arguments
-// Sets up CoreMIDI objects and other bookkeeping/timing data structures
-// For anyone interested in porting Emstrument, this function needs to be modified to use 
-// different libraries than GCD and CoreMIDI.
-static int midi_init(lua_State *L)
+// A growable buffer of raw MIDI messages for each port. All messages of a flush are packed into
+// one batch and each port's messages are handed to the backend with one call, instead of one call
+// per message. If a port's buffer can't grow any more, it is sent and emptied.
+typedef struct {
+    uint8_t *bytes;
+    size_t length;
+    size_t size;
+} portBuffer;
+
+typedef struct messageBatch messageBatch;
+struct messageBatch {
+    portBuffer ports[MAX_PORTS]; // only the context's portCount first ones are used
+    int submissions; // number of backend sends since batchBegin()
+    int messages; // number of messages added since batchBegin()
+    uint64_t baseTime; // when the batch goes out, in ns: timed events are scheduled relative to it
+    bool controllerRefresh; // send controller messages even if the value hasn't changed
+    emstContext *ctx; // the context the batch belongs to
+    void (*sink)(emstContext *ctx, int port, const uint8_t *bytes, size_t length); // where batchSubmit() sends each port's messages
+};
+
+// Buffer size needed to fit n 3-byte messages
+#define BATCH_SIZE(n) (3 * (size_t)(n))
+#define BATCH_BLOCK 1024 // default size of a batch's buffer, in bytes
+
+static bool batchAlloc(messageBatch *batch, size_t size);
+static void batchBegin(messageBatch *batch);
+static void batchSubmit(messageBatch *batch);
+static void sendNoteOn(messageBatch *batch, int ch, int note, int vel);
+static void sendNoteOnWithDuration(messageBatch *batch, int ch, int note, int vel, int duration);
+static void sendNoteOff(messageBatch *batch, int ch, int note);
+static void sendCC(messageBatch *batch, int ch, int CC, int value);
+static void sendPitchBend(messageBatch *batch, int ch, int msb, int lsb);
+static void sendResetNotes(messageBatch *batch, int ch);
+static void sendResetAllNotes(messageBatch *batch);
+static void sendControllerShadow(messageBatch *batch);
+static void sendCommand(messageBatch *batch, command c);
+static int sendFrame(messageBatch *batch, command *commands, int count, command *delayed, bool resync,
+                     int *sent, int *delayedCount);
+static int sendMessages(emstContext *ctx);
+
+// defines how long '1' is for duration arguments
+#define DEFAULT_DURATION_UNIT 16 // roughly 1/60sec by default (in ms)
+// defines how long to wait between sending a note off and a note on message for the same note
+#define DEFAULT_OFFSET 0 // off by default, can be enabled if users are having timestamp issues
+
+// defines how often (in MIDI.sendmessages() calls) unchanged controller values are sent anyway
+#define DEFAULT_RESYNC_INTERVAL 60 // roughly once a second at 60fps, 0 = never
+
+// Name of the virtual MIDI source/port created by the backend for MIDI.init()
+#define ENDPOINT_NAME "EmstrumentMIDISource"
+
+// A transport backend takes batches of complete MIDI messages as raw bytes, and delivers them
+// to whatever is on the other side. Each context opens each of its ports (endpoints) once,
+// with its own name, and keeps the backend's state for it (see outputPort). Calls to send() for
+// the same port are serialized by transportSend(), so backends don't need to be thread safe,
+// but different ports can be sent to at the same time. Ports are closed in reverse order.
+// For anyone interested in porting Emstrument, a new backend needs to be added to kBackends.
+typedef struct {
+    const char *name; // used to select the backend in MIDI.init()
+    bool (*open)(emstContext *ctx, int port, const char *endpointName);
+    void (*send)(emstContext *ctx, int port, const uint8_t *bytes, size_t length);
+    void (*close)(emstContext *ctx, int port);
+} transportBackend;
+
+static const transportBackend *findBackend(const char *name);
+static void transportSend(emstContext *ctx, int port, const uint8_t *bytes, size_t length);
+
+// The OSC backend sends to localhost on this UDP port until MIDI.configureosc() is called
+#define OSC_DEFAULT_HOST "127.0.0.1"
+#define OSC_DEFAULT_PORT 57120
+static void oscDefaultAddress(emstContext *ctx);
+static bool oscSetAddress(emstContext *ctx, const struct sockaddr *address, socklen_t length);
+
+// Single-producer/single-consumer ring of variable-length byte records (a 4-byte length
+// followed by the record's bytes). head and tail count bytes written/read since the start,
+// and are only ever written by the producer and consumer respectively.
+typedef struct {
+    uint8_t *buffer;
+    size_t size; // must be a power of 2
+    atomic_size_t head;
+    atomic_size_t tail;
+    atomic_uint_fast64_t dropped; // records that didn't fit
+} byteRing;
+
+static bool ringInit(byteRing *ring, size_t size);
+static void ringFree(byteRing *ring);
+static bool ringPush(byteRing *ring, const uint8_t *bytes, size_t length);
+static bool ringFits(byteRing *ring, size_t length);
+static bool ringPushWithHeader(byteRing *ring, const void *header, size_t headerLength,
+                               const uint8_t *bytes, size_t length);
+static size_t ringPeek(byteRing *ring);
+static void ringPeekData(byteRing *ring, void *dst, size_t length);
+static void ringPop(byteRing *ring, uint8_t *dst);
+
+// Timed events (note-offs for notes with a duration, delayed note-ons) are handed to the note
+// scheduler, with absolute times in ns on the scheduler's clock (see schedulerNowNs())
+#define WHEEL_SLOTS 512 // must be a power of 2
+#define WHEEL_TICK_NS 1000000 // 1ms resolution
+
+typedef struct scheduledEvent {
+    struct scheduledEvent *prev; // links in the timing wheel slot
+    struct scheduledEvent *next;
+    uint64_t deadline; // in ticks
+    uint64_t time; // exact time the event is due, in ns
+    uint64_t baseTime; // for delayed note ons: the base time of the frame they were played in
+    bool pending;
+    command cmd; // the delayed note on command, or a note off for the channel/note
+    uint32_t noteID; // for note offs: only sent if the note hasn't been played since
+} scheduledEvent;
+
+static bool schedulerInit(emstContext *ctx);
+static void schedulerStop(emstContext *ctx);
+static uint64_t schedulerNowNs(emstContext *ctx);
+static uint64_t schedulerClockNs(emstContext *ctx);
+static void scheduleNoteOff(emstContext *ctx, int ch, int note, uint32_t noteID, uint64_t time);
+static void scheduleNoteOn(emstContext *ctx, command c, uint64_t baseTime, uint64_t time);
+static void cancelNoteOff(emstContext *ctx, int ch, int note);
+static void advanceSchedulerClock(emstContext *ctx, double ms);
+
+// Optional lookahead mode (see MIDI.configurelookahead()): midi_sendMessages() stamps each frame
+// with a target time on a steady frame clock, lookahead ms ahead, and publishes its commands with
+// lookaheadPublish(). The note scheduler sends them when their time comes, so notes start and
+// stop (as far as retriggers, note offs and resets are concerned) at the time they're heard.
+#define FRAME_CLOCK_DEFAULT_NS (1000000000 / 60)
+#define TIMED_BATCH_MAX 16384 // commands per batch in timedRing, bigger frames are split
+static uint64_t lookaheadTarget(emstContext *ctx);
+static int lookaheadPublish(emstContext *ctx, uint64_t target, const command *commands, int count,
+                            bool controllerRefresh, bool resync);
+static void lookaheadWaitUntilSent(emstContext *ctx);
+
+// Header of the batches in timedRing, followed by the frame's commands
+typedef struct {
+    uint64_t target; // when the batch goes out, in ns (first, so it can be peeked on its own)
+    bool controllerRefresh; // see messageBatch
+    bool resync; // send every known controller value first (see MIDI.resync())
+} timedBatchHeader;
+
+// Beat grid (see MIDI.settempo()): quantized note ons wait in the scheduler until the next grid
+// boundary, and are sent by the scheduler thread
+#define DEFAULT_TEMPO 120
+#define DEFAULT_PPQ 4 // grid ticks per quarter note, so one tick is a 16th note by default
+#define GRID_BUCKETS 256 // must be a power of 2
+
+typedef struct {
+    uint64_t tick; // grid tick the note starts on
+    uint64_t time; // set when the note is released: when the tick started, in ns
+    command cmd;
+} quantizedNote;
+
+typedef struct {
+    quantizedNote *notes;
+    int count;
+    int size;
+} gridBucket;
+
+static void setTempo(emstContext *ctx, double bpm, int ppq);
+static bool quantizeNoteOn(emstContext *ctx, command c, int grid);
+static void cancelQuantizedNotes(emstContext *ctx, int ch);
+
+// Optional output thread: when enabled, midi_sendMessages() only publishes each finished batch
+// (see outputThreadPublish()) and the output thread hands it to the backend.
+static bool outputThreadStart(emstContext *ctx, int cpu);
+static void outputThreadStop(emstContext *ctx);
+static void outputThreadPublish(emstContext *ctx, int port, const uint8_t *bytes, size_t length);
+static void outputThreadWaitUntilSent(emstContext *ctx);
+
+// Optional recorder (see MIDI.record()): transportSend() also hands everything it sends to the
+// recorder, which writes it to a Standard MIDI File from its own thread.
+typedef struct {
+    FILE *events; // temporary file with the track's events, NULL until the channel is used
+    uint32_t length; // bytes written to events
+    uint64_t lastTick;
+    uint64_t playingNotes[2]; // notes left on at the end get a note off
+} recorderTrack;
+
+static bool recorderStart(emstContext *ctx, FILE *file);
+static bool recorderStop(emstContext *ctx);
+static void recorderStopAtExit(void);
+static void recorderPush(emstContext *ctx, int port, const uint8_t *bytes, size_t length);
+
+// Statistics (see MIDI.stats()). Flush statistics are only used on the Lua thread, the note off
+// latency histogram is written by the scheduler thread.
+typedef struct {
+    uint64_t frames; // MIDI.sendmessages() calls
+    uint64_t queued; // commands queued
+    uint64_t deduped; // commands removed because they were redundant
+    uint64_t sent; // MIDI messages sent by MIDI.sendmessages()
+    uint64_t delayed; // retriggered note ons, sent after their note off
+    uint64_t flushTime; // time spent in MIDI.sendmessages(), in ns
+    uint64_t maxFlushTime;
+} flushStatistics;
+
+// Log-linear histogram (like HdrHistogram): 4 buckets per power of 2, so values are accurate
+// to within 25%, up to 2^64.
+#define HISTOGRAM_SUB_BUCKETS 4
+#define HISTOGRAM_BUCKETS (64 * HISTOGRAM_SUB_BUCKETS)
+typedef struct {
+    atomic_uint_fast64_t counts[HISTOGRAM_BUCKETS];
+    atomic_uint_fast64_t total;
+    atomic_uint_fast64_t max;
+} histogram;
+
+static uint64_t currentTimeNs(void);
+static void histogramRecord(histogram *h, uint64_t value);
+static uint64_t histogramPercentile(histogram *h, double percentile);
+static void histogramReset(histogram *h);
+static int scheduledNoteOffCount(emstContext *ctx);
+
+// Optional periodic dump of the statistics, one line every stats_interval flushes
+#define DEFAULT_STATS_INTERVAL 600 // roughly every 10 seconds at 60fps
+static void writeStats(emstContext *ctx, FILE *file);
+
+// Note states (see emstContext): bit 0 is set while the note is playing, the rest is its generation
+#define NOTE_PLAYING 1u
+#define NOTE_GENERATION(state) ((state) >> 1)
+
+// An output port: the backend's state for one of a context's endpoints
+typedef struct {
+    pthread_mutex_t lock; // serializes sends to the port
+    byteRing ring; // used by the ring buffer backend
+    emstShmHeader *shm; // used by the shared memory backend
+    size_t shmSize;
+    char shmName[EMST_SHM_NAME_MAX];
+    int oscSocket; // used by the OSC backend
+    uint8_t *oscBuffer;
+#ifdef __APPLE__
+    MIDIEndpointRef endpoint; // typedef-ed UInt32 rather than a pointer
+    Byte *packetListBuffer;
+    ByteCount packetListBufferSize;
+#endif
+#ifdef EMSTRUMENT_ALSA
+    snd_seq_t *seq; // each port has its own sequencer client, so ports don't share a lock
+    int alsaPort;
+#endif
+} outputPort;
+
+struct emstContext {
+    // The backend, and its state for this context's endpoints
+    const transportBackend *transport; // set by MIDI.init()/MIDI.open()
+    outputPort ports[MAX_PORTS];
+    int portCount; // ports opened by MIDI.init()/MIDI.open()
+    int channelCount; // 16 per port, the size of the per-channel arrays below
+    pthread_mutex_t transportLock; // protects the recorder's side of transportSend()
+    // Where the OSC backend sends its bundles (see MIDI.configureosc()), only changed with
+    // every port's lock held
+    struct sockaddr_storage oscAddress;
+    socklen_t oscAddressLength;
+#ifdef __APPLE__
+    MIDIClientRef luaMIDIClient; // these are typedef-ed UInt32s rather than pointers
+#endif
+
+    // Both kept in ns, so scheduling a note is integer arithmetic (see MIDI.configuretiming())
+    uint64_t durationUnitNs;
+    uint64_t lateNoteOffsetNs;
+
+    // Keep track of whether a note is playing, and of the last note played for each note on each
+    // channel so we can 'cancel' the timed note-off event if the same note has been played again
+    // since then (128 notes on every channel).
+    // This is shared by the Lua thread and the scheduler thread, so each note's state is packed into
+    // one atomic word: bit 0 is set while the note is playing, and the other 31 bits are a
+    // generation counter, incremented every time the note is played. Every update is a single
+    // atomic operation (a CAS loop for updates that depend on the current value), so no lock is needed.
+    // Note: the generation wraps around after 2^31 plays of the same note, which is safe unless that
+    // many happen during a single note's duration.
+    _Atomic uint32_t (*noteStates)[128];
+    // Index of the playing notes, one 128-bit set per channel, so that finding every playing note
+    // takes a couple of ctz instructions per playing note instead of a branch for each of the 128 notes.
+    // noteStates is the reference: a bit can be set for a note that has just stopped (the scans
+    // check noteStates), but is never clear while the note is playing.
+    _Atomic uint64_t (*playingNoteBits)[2];
+
+    // Controller shadow: the last value sent for every CC (128 controllers per channel) and the
+    // last pitch bend sent on every channel, -1 if nothing has been sent yet. CC and pitch bend
+    // messages that wouldn't change the receiver's value are dropped, except on refresh frames
+    // (every resync_interval flushes) so that receivers that missed a message catch up eventually.
+    // Only used by the thread that sends the frames: the Lua thread, or the scheduler thread in
+    // lookahead mode.
+    int16_t (*ccShadow)[128];
+    int16_t *pitchBendShadow;
+    bool resyncPending; // set by MIDI.resync(): send every known controller value on the next flush
+    int framesSinceRefresh;
+    int resync_interval;
+
+    command *commandQueue; // Lua API calls add commands to queue.
+    uint32_t commandQueueAllocatedSize; // keep track of queue's dynamically allocated size.
+    int commandQueueIndex; // points to first free entry in commandQueue.
+    // Scratch list used by sendFrame() for note ons that have to be sent after the rest of the
+    // frame. It's always as big as commandQueue, so flushing never needs to allocate memory.
+    command *delayedCommands;
+
+    // Used by midi_sendMessages() on the Lua thread only (not at all in lookahead mode). Its sink is
+    // transportSend(), or outputThreadPublish() when the output thread is enabled.
+    messageBatch flushBatch;
+
+    // Note scheduler, protected by schedulerLock unless noted otherwise
+    bool schedulerStarted;
+    bool schedulerStopping; // tells the scheduler thread to exit
+    pthread_t schedulerThread;
+    pthread_mutex_t schedulerLock;
+    pthread_cond_t schedulerWake; // signalled when the scheduler has something to do again, or sooner than schedulerDeadlineNs
+    uint64_t schedulerDeadlineNs; // when the scheduler thread next has something to do, UINT64_MAX if nothing
+    pthread_mutex_t schedulerTickLock; // serializes schedulerTick() between the scheduler thread and MIDI.advanceclock()
+    scheduledEvent (*scheduledNoteOffs)[128];
+    scheduledEvent (*scheduledNoteOns)[128];
+    scheduledEvent *timingWheel[WHEEL_SLOTS];
+    uint64_t wheelTick; // last tick processed
+    int scheduledCount;
+    int noteOffsScheduled; // how many of them are note offs
+    atomic_bool manualClock; // see schedulerTimeNs()
+    _Atomic uint64_t manualClockNs;
+    messageBatch schedulerBatch; // only used by the scheduler thread
+    scheduledEvent *expiredEvents; // 2 per note, only used by the scheduler thread
+
+    // Lookahead mode. Frames published in lookahead mode go to timedRing as batches of commands,
+    // each prefixed with the time it should go out. The Lua thread is the only producer and schedulerTick() the only
+    // consumer, and target times never go backwards, so only the oldest batch ever needs to be
+    // looked at.
+    double lookahead; // in ms, 0 = off
+    byteRing timedRing;
+    int timedBatchCount; // batches in timedRing, protected by schedulerLock
+    uint64_t timedBatchesPublished; // only used by the Lua thread
+    atomic_uint_fast64_t timedBatchesSent; // counted by the scheduler once a batch has been sent
+    uint8_t *timedRecord; // only used by the scheduler thread
+    size_t timedRecordSize;
+    command *timedDelayedCommands; // sendFrame()'s scratch list for timed batches, room for as many commands as timedRecord
+    uint64_t frameClockNs; // the frame clock is only used on the Lua thread
+    double frameClockPeriodNs;
+    uint64_t lastTargetNs;
+
+    // Beat grid, protected by schedulerLock
+    gridBucket gridBuckets[GRID_BUCKETS];
+    bool gridStarted; // set by the first MIDI.settempo() or MIDI.noteonquantized()
+    double gridTickNs;
+    uint64_t gridOriginNs;
+    uint64_t gridOriginTick;
+    uint64_t gridNextTick; // first grid tick that hasn't been released yet
+    int quantizedCount;
+    quantizedNote *releasedNotes; // only used by the scheduler thread
+    int releasedNotesSize;
+
+    // Output thread
+    byteRing outputRing;
+    uint64_t outputBatchesPublished; // only used by the Lua thread
+    atomic_uint_fast64_t outputBatchesSent; // counted by the output thread once a batch has been sent
+    bool outputThreadRunning;
+    bool outputThreadStopping; // protected by outputThreadLock
+    pthread_t outputThread;
+    atomic_bool outputThreadSleeping;
+    pthread_mutex_t outputThreadLock;
+    pthread_cond_t outputThreadWake;
+
+    // Recorder
+    atomic_bool recording; // written under transportLock, also read without it by transportSend()
+    FILE *recorderFile; // the file being recorded, NULL when not recording
+    byteRing recorderRing;
+    bool recorderRingAllocated;
+    pthread_t recorderThread;
+    atomic_bool recorderStopping;
+    recorderTrack *recorderTracks; // one per channel
+    uint64_t recorderStartNs;
+    bool recorderFailed; // only written by the recorder thread while it runs
+
+    // Statistics
+    flushStatistics lastFlushStats; // the last MIDI.sendmessages() call only
+    flushStatistics totalFlushStats; // since MIDI.init() or the last reset
+    histogram noteOffLatency; // time between a note off's deadline and handing it to the backend, in µs
+    FILE *statsFile;
+    int stats_interval;
+    int framesSinceStatsDump;
+
+    uint8_t *drainRecord; // MIDI.drain()'s buffer
+    size_t drainRecordSize;
+
+    emstContext *next; // in the list of open contexts
+};
+
+// The context of the MIDI.* functions (and of the C API), set up by MIDI.init()
+static emstContext defaultContext;
+
+// Every context that has been set up and not closed yet, so that recordings can be finished
+// when the process exits. Only used when a context is set up or closed.
+static emstContext *openContexts = NULL;
+static pthread_mutex_t openContextsLock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline bool isNotePlaying(emstContext *ctx, int ch, int note)
+{
+    return atomic_load_explicit(&ctx->noteStates[ch][note], memory_order_relaxed) & NOTE_PLAYING;
+}
+
+static inline void setPlayingBit(emstContext *ctx, int ch, int note)
 {
-    if (!luaMIDIClient && !luaMIDIEndpoint && !luaMIDIQueue) {
-        MIDIClientCreate(CFSTR("EnstrumentMIDIClient"), NULL, NULL, &luaMIDIClient);
-        MIDISourceCreate(luaMIDIClient, CFSTR("EmstrumentMIDISource"), &luaMIDIEndpoint);
-        luaMIDIQueue = dispatch_queue_create("emstrument.lua.midiqueue", DISPATCH_QUEUE_CONCURRENT);
+    atomic_fetch_or(&ctx->playingNoteBits[ch][note >> 6], 1ull << (note & 63));
+}
+
+// Sets the bit again if the note was started by another thread while its bit was being cleared
+static inline void restorePlayingBit(emstContext *ctx, int ch, int note)
+{
+    if (atomic_load(&ctx->noteStates[ch][note]) & NOTE_PLAYING) {
+        setPlayingBit(ctx, ch, note);
     }
-    
-    if (!commandQueue) {
-        commandQueue = malloc(CMD_BLOCK * sizeof(command));
-        commandQueueAllocatedSize = CMD_BLOCK; 
-        // initial size = CMD_BLOCK, add CMD_BLOCK more if more commands are queued than capacity.
+}
+
+static inline void clearPlayingBit(emstContext *ctx, int ch, int note)
+{
+    atomic_fetch_and(&ctx->playingNoteBits[ch][note >> 6], ~(1ull << (note & 63)));
+    restorePlayingBit(ctx, ch, note);
+}
+
+// Marks the note as playing with a new generation, which is returned
+static inline uint32_t noteStarted(emstContext *ctx, int ch, int note)
+{
+    uint32_t state = atomic_load_explicit(&ctx->noteStates[ch][note], memory_order_relaxed);
+    uint32_t newState;
+    do {
+        newState = ((NOTE_GENERATION(state) + 1) << 1) | NOTE_PLAYING;
+    } while (!atomic_compare_exchange_weak(&ctx->noteStates[ch][note], &state, newState));
+    setPlayingBit(ctx, ch, note);
+    return NOTE_GENERATION(newState);
+}
+
+// Marks the note as not playing, returns whether it was playing
+static inline bool noteStopped(emstContext *ctx, int ch, int note)
+{
+    if (atomic_fetch_and(&ctx->noteStates[ch][note], ~NOTE_PLAYING) & NOTE_PLAYING) {
+        clearPlayingBit(ctx, ch, note);
+        return true;
     }
-    commandQueueIndex = 0;
+    return false;
+}
 
-    for (int i = 0; i < 16; i++) {
-        for (int j = 0; j < 128; j++) {
-            notePlaying[i][j] = false;
+// Marks the note as not playing only if it's still playing the given generation, returns whether it was
+static inline bool noteExpired(emstContext *ctx, int ch, int note, uint32_t generation)
+{
+    uint32_t state = atomic_load_explicit(&ctx->noteStates[ch][note], memory_order_relaxed);
+    while ((state & NOTE_PLAYING) && (NOTE_GENERATION(state) == generation)) {
+        if (atomic_compare_exchange_weak(&ctx->noteStates[ch][note], &state, state & ~NOTE_PLAYING)) {
+            clearPlayingBit(ctx, ch, note);
+            return true;
         }
     }
-    
-    return 0;
+    return false;
 }
 
-// MIDI.configuretiming(durationunit, [noteondelay])
-// durationunit: integer, unit of duration in milliseconds (for MIDI.noteonwithduration())
-// noteondelay (optional): integer, delay in ms between turning a note off and on again
-// If the note-on delay is 0 some applications will write the 2 events at the same timestamp,
-// and the note on and note off will cancel each other out
-static int midi_configuretiming(lua_State *L)
+static void resetControllerShadow(emstContext *ctx)
 {
-    int args = lua_gettop(L);
-    if ((args < 1) || (args > 2)) {
-        return luaL_error(L, "Invalid number of arguments to MIDI.configuretiming()");
+    memset(ctx->ccShadow, 0xFF, ctx->channelCount * sizeof(*ctx->ccShadow)); // all -1
+    memset(ctx->pitchBendShadow, 0xFF, ctx->channelCount * sizeof(*ctx->pitchBendShadow));
+}
+
+// Makes sure commandQueue (and the scratch space used to send it) can hold size commands,
+// doubling its capacity until it's big enough. Returns false if the memory couldn't be allocated,
+// in which case the queue keeps its old capacity and contents.
+static bool reserveCommands(emstContext *ctx, uint32_t size)
+{
+    if (size <= ctx->commandQueueAllocatedSize) {
+        return true;
+    }
+    if (size > CMD_MAX) {
+        return false;
     }
     
-    duration_unit = luaL_checknumber(L, 1);
-    if (args == 2) {
-        late_note_offset = luaL_checknumber(L, 2);
-        printf("Set late note offset to %f\n", late_note_offset);
+    uint32_t newSize = (ctx->commandQueueAllocatedSize > 0) ? ctx->commandQueueAllocatedSize : CMD_BLOCK;
+    while (newSize < size) {
+        newSize *= 2;
     }
     
-    return 0;
+    command *queue = realloc(ctx->commandQueue, newSize * sizeof(command));
+    if (queue == NULL) {
+        return false;
+    }
+    ctx->commandQueue = queue;
+    command *delayed = realloc(ctx->delayedCommands, newSize * sizeof(command));
+    if (delayed == NULL) {
+        return false; // commandQueue is bigger than it needs to be, which is harmless
+    }
+    ctx->delayedCommands = delayed;
+    ctx->commandQueueAllocatedSize = newSize;
+    
+    if (ctx->flushBatch.ports[0].size < BATCH_SIZE(newSize)) {
+        // if this fails the batch is just sent in several parts
+        batchAlloc(&ctx->flushBatch, BATCH_SIZE(newSize));
+    }
+    return true;
 }
 
-// MIDI.notenumber(notename)
-// notename is a short string with value "[note][octave]", e.g "c#3" or "Fb-2"
-// Octaves go from -2 to 8, C3 is middle C
-// Will return nothing (nil) for an invalid note string
-static int midi_noteNumber(lua_State *L)
+// Adds command, expanding commandQueue if necessary. Returns false if the queue is full and
+// can't be expanded.
+static inline bool tryQueueCommand(emstContext *ctx, command c) {
+    if (ctx->commandQueueIndex == ctx->commandQueueAllocatedSize) {
+        if (!reserveCommands(ctx, ctx->commandQueueAllocatedSize + 1)) {
+            return false;
+        }
+    }
+    ctx->commandQueue[ctx->commandQueueIndex] = c;
+    ctx->commandQueueIndex++;
+    return true;
+}
+
+// Same, but raises a Lua error if the command can't be queued
+static void queueCommand(emstContext *ctx, lua_State *L, command c) {
+    if (!tryQueueCommand(ctx, c)) {
+        luaL_error(L, "Not enough memory to queue MIDI command, call MIDI.sendmessages() more often");
+    }
+}
+
+// Called in various functions to make sure everything is in place.
+static inline bool initcheck(emstContext *ctx) {
+    return (ctx->transport && ctx->commandQueue && ctx->delayedCommands && ctx->flushBatch.ports[0].bytes && ctx->schedulerStarted);
+}
+
+/******** Contexts ********/
+
+#define CONTEXT_METATABLE "Emstrument.MIDI" // metatable of the objects returned by MIDI.open()
+
+// Gives ctx its locks and default settings. The default context is set up when the module is
+// loaded, the others by MIDI.open().
+static void contextInit(emstContext *ctx)
 {
-    int args = lua_gettop(L);
-    if (args != 1)  {
-        return luaL_error(L, "Invalid number of arguments to MIDI.notenumber()");
+    pthread_mutex_init(&ctx->transportLock, NULL);
+    for (int port = 0; port < MAX_PORTS; port++) {
+        pthread_mutex_init(&ctx->ports[port].lock, NULL);
+#ifdef EMSTRUMENT_ALSA
+        ctx->ports[port].alsaPort = -1;
+#endif
+        ctx->ports[port].oscSocket = -1;
     }
+    pthread_mutex_init(&ctx->schedulerLock, NULL);
+    pthread_condattr_t wakeAttributes;
+    pthread_condattr_init(&wakeAttributes);
+#ifndef __APPLE__
+    pthread_condattr_setclock(&wakeAttributes, CLOCK_MONOTONIC); // the clock of currentTimeNs()
+#endif
+    pthread_cond_init(&ctx->schedulerWake, &wakeAttributes);
+    pthread_condattr_destroy(&wakeAttributes);
+    pthread_mutex_init(&ctx->schedulerTickLock, NULL);
+    pthread_mutex_init(&ctx->outputThreadLock, NULL);
+    pthread_cond_init(&ctx->outputThreadWake, NULL);
     
-    size_t length = 0;
-    const char *noteString = lua_tolstring(L, 1, &length);
+    ctx->durationUnitNs = (uint64_t)DEFAULT_DURATION_UNIT * 1000000;
+    ctx->lateNoteOffsetNs = (uint64_t)DEFAULT_OFFSET * 1000000;
+    ctx->resync_interval = DEFAULT_RESYNC_INTERVAL;
+    ctx->stats_interval = DEFAULT_STATS_INTERVAL;
+    ctx->frameClockPeriodNs = FRAME_CLOCK_DEFAULT_NS;
+    oscDefaultAddress(ctx);
     
-    // no string or bad string
-    if (noteString == NULL) {
-        return 0;
-    }
-    // string is too long or short to be valid
-    if ((length < 2) || (length > 4)) {
-        return 0;
-    }
+    ctx->flushBatch.ctx = ctx;
+    ctx->flushBatch.sink = transportSend;
+    ctx->schedulerBatch.ctx = ctx;
+    ctx->schedulerBatch.sink = transportSend;
     
-    int note = 0;
-    char letter = noteString[0];
-    switch(letter) {
-        case 'C':
-        case 'c':
-            note = 0;
-            break;
-        case 'D':
-        case 'd':
-            note = 2;
-            break;
-        case 'E':
-        case 'e':
-            note = 4;
-            break;
-        case 'F':
-        case 'f':
-            note = 5;
-            break;
-        case 'G':
-        case 'g':
-            note = 7;
-            break;
-        case 'A':
-        case 'a':
-            note = 9;
-            break;
-        case 'B':
-        case 'b':
-            note = 11;
-            break;
-        default:
-            return 0; // invalid note letter
+    pthread_mutex_lock(&openContextsLock);
+    ctx->next = openContexts;
+    openContexts = ctx;
+    pthread_mutex_unlock(&openContextsLock);
+}
+
+static void defaultContextInit(void)
+{
+    contextInit(&defaultContext);
+}
+
+// Frees the per-channel state allocated by contextOpenPorts()
+static void contextFreeChannels(emstContext *ctx)
+{
+    free(ctx->noteStates);
+    free(ctx->playingNoteBits);
+    free(ctx->ccShadow);
+    free(ctx->pitchBendShadow);
+    free(ctx->scheduledNoteOffs);
+    free(ctx->scheduledNoteOns);
+    free(ctx->expiredEvents);
+    free(ctx->recorderTracks);
+    ctx->noteStates = NULL;
+    ctx->playingNoteBits = NULL;
+    ctx->ccShadow = NULL;
+    ctx->pitchBendShadow = NULL;
+    ctx->scheduledNoteOffs = NULL;
+    ctx->scheduledNoteOns = NULL;
+    ctx->expiredEvents = NULL;
+    ctx->recorderTracks = NULL;
+}
+
+// Allocates the state of portCount * 16 channels, and opens portCount ports with backend.
+// The first port is called endpointName, the others "<endpointName> 2" etc. Returns false
+// (with nothing left open) if something fails.
+static bool contextOpenPorts(emstContext *ctx, const transportBackend *backend,
+                             const char *endpointName, int portCount)
+{
+    int channelCount = portCount * 16;
+    ctx->noteStates = calloc(channelCount, sizeof(*ctx->noteStates));
+    ctx->playingNoteBits = calloc(channelCount, sizeof(*ctx->playingNoteBits));
+    ctx->ccShadow = calloc(channelCount, sizeof(*ctx->ccShadow));
+    ctx->pitchBendShadow = calloc(channelCount, sizeof(*ctx->pitchBendShadow));
+    ctx->scheduledNoteOffs = calloc(channelCount, sizeof(*ctx->scheduledNoteOffs));
+    ctx->scheduledNoteOns = calloc(channelCount, sizeof(*ctx->scheduledNoteOns));
+    ctx->expiredEvents = calloc(2 * 128 * channelCount, sizeof(*ctx->expiredEvents));
+    ctx->recorderTracks = calloc(channelCount, sizeof(*ctx->recorderTracks));
+    if (!ctx->noteStates || !ctx->playingNoteBits || !ctx->ccShadow || !ctx->pitchBendShadow ||
+        !ctx->scheduledNoteOffs || !ctx->scheduledNoteOns || !ctx->expiredEvents || !ctx->recorderTracks) {
+        contextFreeChannels(ctx);
+        return false;
     }
     
-    int strIndex = 1;
-    if (noteString[strIndex] == '#') {
-        note++;
-        strIndex++;
+    for (int port = 0; port < portCount; port++) {
+        char name[256];
+        if (port == 0) {
+            snprintf(name, sizeof(name), "%s", endpointName);
+        } else {
+            snprintf(name, sizeof(name), "%s %d", endpointName, port + 1);
+        }
+        if (!backend->open(ctx, port, name)) {
+            while (port-- > 0) {
+                backend->close(ctx, port);
+            }
+            contextFreeChannels(ctx);
+            return false;
+        }
     }
-    if (noteString[strIndex] == 'b') {
-        note--;
-        strIndex++;
+    ctx->portCount = portCount;
+    ctx->channelCount = channelCount;
+    return true;
+}
+
+// Opens the backend's ports (unless they're already open) with endpointName, and sets up
+// everything else MIDI.init() and MIDI.open() set up. Raises a Lua error from the function
+// called caller if something can't be set up.
+static void contextSetup(emstContext *ctx, lua_State *L, const transportBackend *backend,
+                         const char *endpointName, int portCount, const char *caller)
+{
+    if (!ctx->transport) {
+        if (!contextOpenPorts(ctx, backend, endpointName, portCount)) {
+            luaL_error(L, "%s couldn't open the %s backend", caller, backend->name);
+        }
+        ctx->transport = backend;
     }
     
-    // string didn't have an octave number
-    if (strIndex >= length) {
-        return 0;
+    if (!ctx->schedulerStarted && !schedulerInit(ctx)) {
+        luaL_error(L, "%s couldn't start the note scheduler", caller);
     }
     
-    int octaveMultiplier = 1;
-    if (noteString[strIndex] == '-') {
-        octaveMultiplier = -1;
-        strIndex++;
+    if (!ctx->flushBatch.ports[0].bytes) {
+        batchAlloc(&ctx->flushBatch, BATCH_BLOCK);
     }
     
-    // string didn't have an octave number
-    if (strIndex >= length) {
-        return 0;
+    // initial size = CMD_BLOCK, doubled if more commands are queued than capacity.
+    if (!reserveCommands(ctx, CMD_BLOCK)) {
+        luaL_error(L, "%s couldn't allocate the command queue", caller);
     }
+    ctx->commandQueueIndex = 0;
     
-    char octaveChar = noteString[strIndex];
-    int octave = octaveMultiplier * (octaveChar - '0');
-    
-    int finalnote = 12 * (2 + octave) + note;
-    if ((finalnote > 127) || (finalnote < 0)) {
-        return 0; // note is too high or low
+    for (int i = 0; i < ctx->channelCount; i++) {
+        for (int j = 0; j < 128; j++) {
+            noteStopped(ctx, i, j);
+        }
     }
     
-    lua_pushinteger(L, finalnote);
-    return 1;
+    resetControllerShadow(ctx);
+    ctx->framesSinceRefresh = 0;
+    ctx->resyncPending = false;
+    
+    memset(&ctx->totalFlushStats, 0, sizeof(ctx->totalFlushStats));
+    memset(&ctx->lastFlushStats, 0, sizeof(ctx->lastFlushStats));
+    histogramReset(&ctx->noteOffLatency);
 }
 
-// MIDI.noteon(notenumber, velocity, [channel = 1])
-// notenumber: integer 0-127
-// velocity: integer 1-127
-// channel (optional): integer 1-16
-static int midi_noteon(lua_State *L)
+// Turns off everything still playing, finishes the recording, stops the threads, closes the
+// backend and frees ctx. Only for contexts from MIDI.open(), the default context is never closed.
+static void contextClose(emstContext *ctx)
 {
-    int args = lua_gettop(L);
-    if ((args < 2) || (args > 3)) {
-        return luaL_error(L, "Invalid number of arguments to MIDI.noteon()");
+    if (initcheck(ctx)) {
+        // like MIDI.panic(), but nothing can be done if the command can't be queued
+        if (tryQueueCommand(ctx, makeCommand(kResetAllNotes, 0, 0, 0, 0))) {
+            sendMessages(ctx);
+        }
+        if (ctx->lookahead > 0) {
+            lookaheadWaitUntilSent(ctx);
+        }
+    }
+    if (ctx->recorderFile != NULL) {
+        recorderStop(ctx);
     }
     
-    if (!initcheck()) {
-        return luaL_error(L, "Must call MIDI.init() before MIDI.noteon()");
+    pthread_mutex_lock(&openContextsLock);
+    for (emstContext **link = &openContexts; *link != NULL; link = &(*link)->next) {
+        if (*link == ctx) {
+            *link = ctx->next;
+            break;
+        }
     }
+    pthread_mutex_unlock(&openContextsLock);
     
-    int note = luaL_checkinteger(L, 1) & 0x7F; // keep note in 0-127 range
-    int vel = luaL_checkinteger(L, 2) & 0x7F; // keep velocity in 0-127 range
-    // 0 velocity = no-op (might otherwise act as a note off)
-    if (vel == 0) {
-        return 0;
+    schedulerStop(ctx);
+    outputThreadStop(ctx);
+    if (ctx->transport) {
+        for (int port = ctx->portCount - 1; port >= 0; port--) {
+            ctx->transport->close(ctx, port);
+        }
+    }
+    if (ctx->statsFile != NULL) {
+        fclose(ctx->statsFile);
     }
     
-    int channel = 0;
-    if (args == 3) {
-        channel = luaL_checkinteger(L, 3);
-        // Channel argument is in range 1-16, subtract 1 for zero-indexed channel.
-        // Argument of '0' will still go to zero-indexed channel 0.
-        channel--;
-        if (channel < 0) channel = 0;
-        if (channel > 15) channel = 15;
+    free(ctx->commandQueue);
+    free(ctx->delayedCommands);
+    for (int port = 0; port < MAX_PORTS; port++) {
+        free(ctx->flushBatch.ports[port].bytes);
+        free(ctx->schedulerBatch.ports[port].bytes);
+    }
+    ringFree(&ctx->timedRing);
+    free(ctx->timedRecord);
+    free(ctx->timedDelayedCommands);
+    for (int i = 0; i < GRID_BUCKETS; i++) {
+        free(ctx->gridBuckets[i].notes);
     }
+    free(ctx->releasedNotes);
+    if (ctx->recorderRingAllocated) {
+        ringFree(&ctx->recorderRing);
+    }
+    free(ctx->drainRecord);
+    contextFreeChannels(ctx);
     
-    command noteOnCommand;
-    noteOnCommand.type = kNoteOn;
-    noteOnCommand.channel = channel;
-    noteOnCommand.note = note;
-    noteOnCommand.velocity = vel;
-    queueCommand(noteOnCommand);
-        
-    return 0;
+    pthread_mutex_destroy(&ctx->transportLock);
+    for (int port = 0; port < MAX_PORTS; port++) {
+        pthread_mutex_destroy(&ctx->ports[port].lock);
+    }
+    pthread_mutex_destroy(&ctx->schedulerLock);
+    pthread_cond_destroy(&ctx->schedulerWake);
+    pthread_mutex_destroy(&ctx->schedulerTickLock);
+    pthread_mutex_destroy(&ctx->outputThreadLock);
+    pthread_cond_destroy(&ctx->outputThreadWake);
+    free(ctx);
 }
 
-// MIDI.noteoff(notenumber, [channel = 1])
-// notenumber: integer 0-127
-// channel (optional): integer 1-16
-static int midi_noteoff(lua_State *L)
+// The context a MIDI.* function works on. The methods of the objects returned by MIDI.open()
+// are the same functions with a true upvalue: for those, the object is checked and removed
+// from the stack, so the other arguments are where the MIDI.* function expects them.
+static emstContext *contextArg(lua_State *L)
 {
-    int args = lua_gettop(L);
+    if (!lua_toboolean(L, lua_upvalueindex(1))) {
+        return &defaultContext;
+    }
+    emstContext **handle = luaL_checkudata(L, 1, CONTEXT_METATABLE);
+    if (*handle == NULL) {
+        luaL_error(L, "MIDI object used after close()");
+    }
+    lua_remove(L, 1);
+    return *handle;
+}
+
+/******** API calls ********/
+
+// Reads the optional number of ports at index, 0 if it's missing
+static int portCountArg(lua_State *L, int index, const char *caller)
+{
+    int portCount = luaL_optinteger(L, index, 0);
+    if ((portCount < 0) || (portCount > MAX_PORTS)) {
+        luaL_error(L, "%s can open 1 to %d ports", caller, MAX_PORTS);
+    }
+    return portCount;
+}
+
+// MIDI.init([backend], [ports])
+// backend (optional): string, name of the transport backend to use. Defaults to "coremidi"
+// on OS X. "ringbuffer" keeps messages in memory, to be read with MIDI.drain(). Pass nil to
+// use the default with a number of ports.
+// ports (optional): integer, number of virtual MIDI sources/ports to create, 1 to 16 (default 1).
+// Each port has its own 16 channels: channels 1-16 go to the first port, 17-32 to the second one etc.
+// Sets up the backend and other bookkeeping/timing data structures
+// The backend and the number of ports can only be chosen the first time this is called.
+static int midi_init(lua_State *L)
+{
+    emstContext *ctx = &defaultContext;
+    int args = lua_gettop(L);
+    if (args > 2) {
+        return luaL_error(L, "Invalid number of arguments to MIDI.init()");
+    }
+    
+    const transportBackend *backend = findBackend(luaL_optstring(L, 1, NULL));
+    if (backend == NULL) {
+        return luaL_error(L, "Unknown backend passed to MIDI.init()");
+    }
+    int portCount = portCountArg(L, 2, "MIDI.init()");
+    
+    if (ctx->transport && !lua_isnoneornil(L, 1) && (backend != ctx->transport)) {
+        return luaL_error(L, "MIDI.init() already set up the %s backend", ctx->transport->name);
+    }
+    if (ctx->transport && (portCount > 0) && (portCount != ctx->portCount)) {
+        return luaL_error(L, "MIDI.init() already set up %d port(s)", ctx->portCount);
+    }
+    
+    contextSetup(ctx, L, backend, ENDPOINT_NAME, (portCount > 0) ? portCount : 1, "MIDI.init()");
+    return 0;
+}
+
+// MIDI.open(name, [backend], [ports])
+// name: string, name of the new virtual MIDI source/port
+// backend (optional): string, name of the transport backend to use, like MIDI.init()
+// ports (optional): integer, number of ports to create, like MIDI.init(). The second one is
+// called "<name> 2" etc.
+// Returns a new, independent instance of Emstrument: an object with its own endpoints, command
+// queue, note scheduler and threads, which has every MIDI.* function except init(), open(),
+// notenumber(), notenumbers() and channel() as a method (e.g. synth:noteon(60, 100)). Instances
+// don't share any state or locks with each other or with the MIDI.* functions, so several
+// emulators or scripts in one process don't get in each other's way.
+static int midi_open(lua_State *L)
+{
+    int args = lua_gettop(L);
+    if ((args < 1) || (args > 3)) {
+        return luaL_error(L, "Invalid number of arguments to MIDI.open()");
+    }
+    
+    const char *name = luaL_checkstring(L, 1);
+    const transportBackend *backend = findBackend(luaL_optstring(L, 2, NULL));
+    if (backend == NULL) {
+        return luaL_error(L, "Unknown backend passed to MIDI.open()");
+    }
+    int portCount = portCountArg(L, 3, "MIDI.open()");
+    
+    // the object comes first, so that a context that fails to set up is closed when it's collected
+    emstContext **handle = lua_newuserdata(L, sizeof(emstContext *));
+    *handle = NULL;
+    luaL_getmetatable(L, CONTEXT_METATABLE);
+    lua_setmetatable(L, -2);
+    
+    emstContext *ctx = calloc(1, sizeof(emstContext));
+    if (ctx == NULL) {
+        return luaL_error(L, "MIDI.open() couldn't allocate the instance");
+    }
+    contextInit(ctx);
+    *handle = ctx;
+    
+    contextSetup(ctx, L, backend, name, (portCount > 0) ? portCount : 1, "MIDI.open()");
+    return 1;
+}
+
+// instance:close()
+// No arguments
+// Turns off every note still playing on the instance, finishes its recording (see MIDI.record()),
+// stops its threads and closes its endpoint. The instance can't be used afterwards. Instances
+// that are garbage collected are closed automatically.
+static int midi_close(lua_State *L)
+{
+    emstContext **handle = luaL_checkudata(L, 1, CONTEXT_METATABLE);
+    if (lua_gettop(L) != 1) {
+        return luaL_error(L, "Invalid number of arguments to close()");
+    }
+    
+    if (*handle != NULL) {
+        contextClose(*handle);
+        *handle = NULL;
+    }
+    return 0;
+}
+
+// MIDI.configuretiming(durationunit, [noteondelay])
+// durationunit: integer, unit of duration in milliseconds (for MIDI.noteonwithduration())
+// noteondelay (optional): integer, delay in ms between turning a note off and on again
+// If the note-on delay is 0 some applications will write the 2 events at the same timestamp,
+// and the note on and note off will cancel each other out
+static int midi_configuretiming(lua_State *L)
+{
+    emstContext *ctx = contextArg(L);
+    int args = lua_gettop(L);
     if ((args < 1) || (args > 2)) {
-        return luaL_error(L, "Invalid number of arguments to MIDI.noteoff()");
+        return luaL_error(L, "Invalid number of arguments to MIDI.configuretiming()");
     }
     
-    if (!initcheck()) {
-        return luaL_error(L, "Must call MIDI.init() before MIDI.noteoff()");
+    double durationUnit = luaL_checknumber(L, 1);
+    ctx->durationUnitNs = (durationUnit > 0) ? (uint64_t)(durationUnit * 1000000) : 0;
+    if (args == 2) {
+        double lateNoteOffset = luaL_checknumber(L, 2);
+        ctx->lateNoteOffsetNs = (lateNoteOffset > 0) ? (uint64_t)(lateNoteOffset * 1000000) : 0;
     }
     
-    int note = luaL_checkinteger(L, 1) & 0x7F; // keeps note in 0-127 range
+    return 0;
+}
+
+// MIDI.configureoutputthread(enabled, [cpu])
+// enabled: boolean, whether to send messages from a dedicated output thread
+// cpu (optional): integer, index of the CPU core to pin the output thread to (Linux only)
+// When enabled, MIDI.sendmessages() only hands the finished messages over to the output thread,
+// so the Lua thread never waits for the MIDI backend.
+static int midi_configureoutputthread(lua_State *L)
+{
+    emstContext *ctx = contextArg(L);
+    int args = lua_gettop(L);
+    if ((args < 1) || (args > 2)) {
+        return luaL_error(L, "Invalid number of arguments to MIDI.configureoutputthread()");
+    }
     
-    int channel = 0;
+    if (!initcheck(ctx)) {
+        return luaL_error(L, "Must call MIDI.init() before MIDI.configureoutputthread()");
+    }
+    
+    bool enabled = lua_toboolean(L, 1);
+    int cpu = -1;
     if (args == 2) {
-        channel = luaL_checkinteger(L, 2);
-        // Channel argument is in range 1-16, subtract 1 for zero-indexed channel.
-        // Argument of '0' will still go to zero-indexed channel 0.
-        channel--;
-        if (channel < 0) channel = 0;
-        if (channel > 15) channel = 15;
+        cpu = luaL_checkinteger(L, 2);
     }
     
-    command noteOffCommand;
-    noteOffCommand.type = kNoteOff;
-    noteOffCommand.channel = channel;
-    noteOffCommand.note = note;
-    queueCommand(noteOffCommand);
+    if (enabled) {
+        if (!outputThreadStart(ctx, cpu)) {
+            return luaL_error(L, "MIDI.configureoutputthread() couldn't start the output thread");
+        }
+        ctx->flushBatch.sink = outputThreadPublish;
+    } else if (ctx->flushBatch.sink != transportSend) {
+        // everything already published needs to go out before sending from the Lua thread again
+        outputThreadWaitUntilSent(ctx);
+        ctx->flushBatch.sink = transportSend;
+    }
     
     return 0;
 }
 
-// MIDI.noteonwithduration(notenumber, velocity, duration, [channel = 1])
-// notenumber: integer 0-127
-// velocity: integer 1-127
-// duration: integer in 60ths of a second (or a user-set value)
-// channel (optional): integer 1-16
-static int midi_noteonwithduration(lua_State *L)
+// MIDI.configurelookahead(ms)
+// ms: number, how far ahead of the frame clock to send each frame's messages, 0 = off (default)
+// Instead of sending messages as soon as MIDI.sendmessages() is called, which makes the timing
+// of the messages as jittery as the emulator's frames, each frame is sent at a fixed time after
+// the start of the frame, on a clock that follows the emulator's average frame rate. Note offs
+// and delayed note ons are delayed by the same amount, so timing within a frame is exact.
+static int midi_configurelookahead(lua_State *L)
 {
+    emstContext *ctx = contextArg(L);
     int args = lua_gettop(L);
-    if ((args < 3) || (args > 4)) {
-        return luaL_error(L, "Invalid number of arguments to MIDI.noteonwithduration()");
+    if (args != 1) {
+        return luaL_error(L, "Invalid number of arguments to MIDI.configurelookahead()");
     }
     
-    if (!initcheck()) {
-        return luaL_error(L, "Must call MIDI.init() before MIDI.noteonwithduration()");
+    if (!initcheck(ctx)) {
+        return luaL_error(L, "Must call MIDI.init() before MIDI.configurelookahead()");
     }
     
-    int note = luaL_checkinteger(L, 1) & 0x7F; // keeps note in 0-127 range
-    int vel = luaL_checkinteger(L, 2) & 0x7F; // keeps velocity in 0-127 range
-    // do nothing for 0 velocity
-        if (vel == 0) {
-        return 0;
+    double ms = luaL_checknumber(L, 1);
+    if (ms < 0) {
+        ms = 0;
     }
-    int duration = luaL_checkinteger(L, 3);
-    // do nothing for 0 or negative duration
-    if (!(duration > 0)) {
-        return 0;
+    
+    if ((ms == 0) && (ctx->lookahead > 0)) {
+        // frames that are still waiting go out first
+        lookaheadWaitUntilSent(ctx);
     }
+    ctx->lookahead = ms;
     
-    int channel = 0;
-    if (args == 4) {
-        channel = luaL_checkinteger(L, 4);
-        // Channel argument is in range 1-16, subtract 1 for zero-indexed channel.
-        // Argument of '0' will still go to zero-indexed channel 0.
-        channel--;
-        if (channel < 0) channel = 0;
-        if (channel > 15) channel = 15;
+    return 0;
+}
+
+// MIDI.configureosc(host, port)
+// host: string, host name or IP address to send OSC bundles to
+// port: integer, UDP port to send them to
+// Only for the osc backend: sets where it sends its bundles (localhost, port 57120 by default).
+// Can be called before MIDI.init().
+static int midi_configureosc(lua_State *L)
+{
+    emstContext *ctx = contextArg(L);
+    int args = lua_gettop(L);
+    if (args != 2) {
+        return luaL_error(L, "Invalid number of arguments to MIDI.configureosc()");
+    }
+    
+    const char *host = luaL_checkstring(L, 1);
+    int port = luaL_checkinteger(L, 2);
+    if ((port < 1) || (port > 65535)) {
+        return luaL_error(L, "Invalid UDP port passed to MIDI.configureosc()");
+    }
+    
+    if (ctx->transport && (ctx->transport != findBackend("osc"))) {
+        return luaL_error(L, "MIDI.configureosc() only works with the osc backend");
     }
     
-    command noteOnCommand;
-    noteOnCommand.type = kNoteOnWithDuration;
-    noteOnCommand.channel = channel;
-    noteOnCommand.note = note;
-    noteOnCommand.velocity = vel;
-    noteOnCommand.duration = duration;
-    queueCommand(noteOnCommand);
+    char service[8];
+    snprintf(service, sizeof(service), "%d", port);
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    struct addrinfo *addresses;
+    if (getaddrinfo(host, service, &hints, &addresses) != 0) {
+        return luaL_error(L, "MIDI.configureosc() couldn't find host '%s'", host);
+    }
+    bool ok = oscSetAddress(ctx, addresses->ai_addr, addresses->ai_addrlen);
+    freeaddrinfo(addresses);
+    if (!ok) {
+        return luaL_error(L, "MIDI.configureosc() couldn't open a socket for '%s'", host);
+    }
     
     return 0;
 }
 
-// MIDI.CC(CC, value, [channel = 1])
-// CC: integer 0-120
-// value: integer 0-127
-// channel (optional): integer 1-16
-static int midi_CC(lua_State *L)
+// MIDI.configureresync(interval)
+// interval: integer, number of MIDI.sendmessages() calls between controller refreshes, 0 = never
+// CC and pitch bend messages that don't change the last value sent are dropped. Every interval
+// frames they are sent regardless, so receivers that missed something catch up.
+static int midi_configureresync(lua_State *L)
 {
+    emstContext *ctx = contextArg(L);
     int args = lua_gettop(L);
-    if ((args < 2) || (args > 3)) {
-        return luaL_error(L, "Invalid number of arguments to MIDI.CC()");
+    if (args != 1) {
+        return luaL_error(L, "Invalid number of arguments to MIDI.configureresync()");
     }
     
-    if (!initcheck()) {
-        return luaL_error(L, "Must call MIDI.init() before MIDI.CC()");
+    int interval = luaL_checkinteger(L, 1);
+    if (interval < 0) {
+        interval = 0;
     }
+    ctx->resync_interval = interval;
+    ctx->framesSinceRefresh = 0;
     
-    int CC = luaL_checkinteger(L, 1); 
-    // keep CC in 0-119 range
-    if (CC < 0) {
-        CC = 0;
+    return 0;
+}
+
+// MIDI.resync()
+// No arguments
+// Sends the last value of every CC and pitch bend sent so far on the next MIDI.sendmessages(),
+// e.g. after connecting a new MIDI receiver.
+static int midi_resync(lua_State *L)
+{
+    emstContext *ctx = contextArg(L);
+    int args = lua_gettop(L);
+    if (args > 0) {
+        return luaL_error(L, "Invalid number of arguments to MIDI.resync()");
     }
-    if (CC > 119) {
-        CC = 119;
+    
+    if (!initcheck(ctx)) {
+        return luaL_error(L, "Must call MIDI.init() before MIDI.resync()");
     }
     
-    int value = luaL_checkinteger(L, 2) & 0x7F; // keeps value in 0-127 range
-    int channel = 0;
+    ctx->resyncPending = true;
     
-    if (args == 3) {
-        channel = luaL_checkinteger(L,3);
-        // Channel argument is in range 1-16, subtract 1 for zero-indexed channel.
-        // Argument of '0' will still go to zero-indexed channel 0.
-        channel--;
-        if (channel < 0) channel = 0;
-        if (channel > 15) channel = 15;
+    return 0;
+}
+
+// MIDI.reserve(count)
+// count: integer, number of commands to make room for
+// Pre-sizes the command queue (and the buffers used to send it) so that queueing up to count
+// commands between MIDI.sendmessages() calls never needs to allocate memory.
+static int midi_reserve(lua_State *L)
+{
+    emstContext *ctx = contextArg(L);
+    int args = lua_gettop(L);
+    if (args != 1) {
+        return luaL_error(L, "Invalid number of arguments to MIDI.reserve()");
+    }
+    
+    if (!initcheck(ctx)) {
+        return luaL_error(L, "Must call MIDI.init() before MIDI.reserve()");
     }
     
-    command ccCommand;
-    ccCommand.type = kCC;
-    ccCommand.channel = channel;
-    ccCommand.CC = CC;
-    ccCommand.value = value;
-    queueCommand(ccCommand);
+    int count = luaL_checkinteger(L, 1);
+    if (count > CMD_MAX) {
+        return luaL_error(L, "MIDI.reserve() can't reserve more than %d commands", CMD_MAX);
+    }
+    if (count > 0 && !reserveCommands(ctx, count)) {
+        return luaL_error(L, "MIDI.reserve() couldn't allocate room for %d commands", count);
+    }
     
     return 0;
 }
 
-// MIDI.pitchbend(bend, [channel = 1])
-// bend: float, -1 to 1 (min and max pitch bend, respectively)
-// channel (optional): integer 1-16
-static int midi_pitchbend(lua_State *L)
+// Parses a note name ("[note][octave]", see MIDI.notenumber()), returns -1 if it isn't valid
+static int parseNoteName(const char *noteString, size_t length)
 {
-    int args = lua_gettop(L);
-    if ((args < 1) || (args > 2)) {
-        return luaL_error(L, "Invalid number of arguments to MIDI.pitchbend()");
+    // string is too long or short to be valid
+    if ((length < 2) || (length > 4)) {
+        return -1;
     }
     
-    if (!initcheck()) {
-        return luaL_error(L, "Must call MIDI.init() before MIDI.pitchbend()");
+    int note = 0;
+    char letter = noteString[0];
+    switch(letter) {
+        case 'C':
+        case 'c':
+            note = 0;
+            break;
+        case 'D':
+        case 'd':
+            note = 2;
+            break;
+        case 'E':
+        case 'e':
+            note = 4;
+            break;
+        case 'F':
+        case 'f':
+            note = 5;
+            break;
+        case 'G':
+        case 'g':
+            note = 7;
+            break;
+        case 'A':
+        case 'a':
+            note = 9;
+            break;
+        case 'B':
+        case 'b':
+            note = 11;
+            break;
+        default:
+            return -1; // invalid note letter
     }
     
-    float value = luaL_checknumber(L, 1);
-    if (value > 1.0) {
-        value = 1.0;
+    int strIndex = 1;
+    if (noteString[strIndex] == '#') {
+        note++;
+        strIndex++;
+    }
+    if (noteString[strIndex] == 'b') {
+        note--;
+        strIndex++;
     }
-    if (value < -1.0) {
-        value = -1.0;
+    
+    // string didn't have an octave number
+    if (strIndex >= length) {
+        return -1;
     }
     
-    int channel = 0;
-    if (args == 2) {
-        channel = luaL_checkinteger(L, 2);
-        // Channel argument is in range 1-16, subtract 1 for zero-indexed channel.
-        // Argument of '0' will still go to zero-indexed channel 0.
-        channel--;
-        if (channel < 0) channel = 0;
-        if (channel > 15) channel = 15;
+    int octaveMultiplier = 1;
+    if (noteString[strIndex] == '-') {
+        octaveMultiplier = -1;
+        strIndex++;
     }
     
-    // pitch value is a 14 bit value, center is 0x2000 = 8192 = (1 << 13)
-    int delta14b = roundf(8191.0 * value);
-    int pbvalue14b = 8192 + delta14b;
-    int pbvalueL7b = (pbvalue14b & 0x7F);
-    int pbvalueM7b = ((pbvalue14b >> 7) & 0x7F);
+    // string didn't have an octave number
+    if (strIndex >= length) {
+        return -1;
+    }
     
-    //printf("14 bits: %d\tLSB: %d\tMSB: %d\n", pbvalue14b, pbvalueL7b, pbvalueM7b);
-        
-    command pitchBendCommand;
-    pitchBendCommand.type = kPitchBend;
-    pitchBendCommand.channel = channel;
-    pitchBendCommand.MS7b = pbvalueM7b;
-    pitchBendCommand.LS7b = pbvalueL7b;
-    queueCommand(pitchBendCommand);
+    char octaveChar = noteString[strIndex];
+    int octave = octaveMultiplier * (octaveChar - '0');
+    
+    int finalnote = 12 * (2 + octave) + note;
+    if ((finalnote > 127) || (finalnote < 0)) {
+        return -1; // note is too high or low
+    }
+    
+    return finalnote;
+}
+
+// Note names are at most 4 characters long, so a name (and its length) fits in a 64 bit key,
+// which is used to look up names that have already been parsed in a small open-addressing
+// hash table. Scripts only use a handful of different names, so the table never fills up in
+// practice; if it does, names that aren't in it are just parsed every time. The table doesn't
+// depend on the context, so it's shared by all of them, with a copy per thread so that contexts
+// used from different threads don't need a lock.
+#define NOTE_NAME_CACHE_SIZE 1024 // must be a power of 2
+
+typedef struct {
+    uint64_t key; // 0 = empty
+    int note; // -1 for invalid names
+} noteNameCacheEntry;
+
+static _Thread_local noteNameCacheEntry noteNameCache[NOTE_NAME_CACHE_SIZE];
+static _Thread_local int noteNameCacheCount;
+
+static int lookupNoteName(const char *noteString, size_t length)
+{
+    if ((length < 2) || (length > 4)) {
+        return -1;
+    }
+    uint32_t chars = 0;
+    memcpy(&chars, noteString, length);
+    uint64_t key = ((uint64_t)length << 32) | chars;
+    
+    uint32_t slot = (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 54) & (NOTE_NAME_CACHE_SIZE - 1);
+    while (noteNameCache[slot].key != 0) {
+        if (noteNameCache[slot].key == key) {
+            return noteNameCache[slot].note;
+        }
+        slot = (slot + 1) & (NOTE_NAME_CACHE_SIZE - 1);
+    }
+    
+    int note = parseNoteName(noteString, length);
+    if (noteNameCacheCount < NOTE_NAME_CACHE_SIZE / 2) {
+        noteNameCache[slot].key = key;
+        noteNameCache[slot].note = note;
+        noteNameCacheCount++;
+    }
+    return note;
+}
+
+// Reads the notes of a chord at stack index idx into notes (which must fit 128 notes), and
+// returns how many there are. A chord is either a string of note names separated by spaces or
+// commas ("C3 E3 G3"), or a table of note names and/or note numbers. Raises a Lua error for
+// anything that isn't a note.
+static int readChord(lua_State *L, int idx, int *notes, const char *function)
+{
+    int count = 0;
+    if (lua_type(L, idx) == LUA_TSTRING) {
+        size_t length;
+        const char *chord = lua_tolstring(L, idx, &length);
+        size_t i = 0;
+        while (i < length) {
+            if ((chord[i] == ' ') || (chord[i] == ',')) {
+                i++;
+                continue;
+            }
+            size_t start = i;
+            while ((i < length) && (chord[i] != ' ') && (chord[i] != ',')) {
+                i++;
+            }
+            int note = lookupNoteName(&chord[start], i - start);
+            if (note < 0) {
+                lua_pushlstring(L, &chord[start], i - start);
+                return luaL_error(L, "Invalid note name '%s' passed to %s", lua_tostring(L, -1), function);
+            }
+            if (count == 128) {
+                return luaL_error(L, "Too many notes passed to %s", function);
+            }
+            notes[count] = note;
+            count++;
+        }
+    } else if (lua_type(L, idx) == LUA_TTABLE) {
+        int length = (int)lua_objlen(L, idx);
+        if (length > 128) {
+            return luaL_error(L, "Too many notes passed to %s", function);
+        }
+        for (int i = 1; i <= length; i++) {
+            lua_rawgeti(L, idx, i);
+            int note = -1;
+            if (lua_type(L, -1) == LUA_TNUMBER) {
+                lua_Integer number = lua_tointeger(L, -1);
+                if ((number >= 0) && (number <= 127)) {
+                    note = (int)number;
+                }
+            } else if (lua_type(L, -1) == LUA_TSTRING) {
+                size_t nameLength;
+                const char *name = lua_tolstring(L, -1, &nameLength);
+                note = lookupNoteName(name, nameLength);
+            }
+            if (note < 0) {
+                return luaL_error(L, "Invalid note %d passed to %s", i, function);
+            }
+            lua_pop(L, 1);
+            notes[count] = note;
+            count++;
+        }
+    } else {
+        return luaL_error(L, "%s needs a string or table of notes", function);
+    }
+    return count;
+}
+
+// MIDI.notenumber(notename)
+// notename is a short string with value "[note][octave]", e.g "c#3" or "Fb-2"
+// Octaves go from -2 to 8, C3 is middle C
+// Will return nothing (nil) for an invalid note string
+static int midi_noteNumber(lua_State *L)
+{
+    int args = lua_gettop(L);
+    if (args != 1)  {
+        return luaL_error(L, "Invalid number of arguments to MIDI.notenumber()");
+    }
+    
+    size_t length = 0;
+    const char *noteString = lua_tolstring(L, 1, &length);
+    
+    // no string or bad string
+    if (noteString == NULL) {
+        return 0;
+    }
+    
+    int note = lookupNoteName(noteString, length);
+    if (note < 0) {
+        return 0;
+    }
+    
+    lua_pushinteger(L, note);
+    return 1;
+}
+
+// MIDI.notenumbers(notes)
+// notes: string of note names separated by spaces or commas (e.g. "C3 E3 G3"), or a table of
+// note names and/or numbers
+// Returns a table with the number of every note, in the same order
+static int midi_noteNumbers(lua_State *L)
+{
+    int args = lua_gettop(L);
+    if (args != 1)  {
+        return luaL_error(L, "Invalid number of arguments to MIDI.notenumbers()");
+    }
+    
+    int notes[128];
+    int count = readChord(L, 1, notes, "MIDI.notenumbers()");
+    
+    lua_createtable(L, count, 0);
+    for (int i = 0; i < count; i++) {
+        lua_pushinteger(L, notes[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+    return 1;
+}
+
+// MIDI.channel(port, channel)
+// port: integer, 1 to the number of ports (see MIDI.init())
+// channel: integer 1-16, the MIDI channel on that port
+// Returns the channel number to pass to the other functions to address that port's channel,
+// e.g. MIDI.noteon(60, 100, MIDI.channel(2, 10)) plays a note on channel 10 of the second port
+static int midi_channel(lua_State *L)
+{
+    int args = lua_gettop(L);
+    if (args != 2)  {
+        return luaL_error(L, "Invalid number of arguments to MIDI.channel()");
+    }
+    
+    int port = luaL_checkinteger(L, 1);
+    int channel = luaL_checkinteger(L, 2);
+    if ((port < 1) || (port > MAX_PORTS) || (channel < 1) || (channel > 16)) {
+        return luaL_error(L, "Invalid port or channel passed to MIDI.channel()");
+    }
+    
+    lua_pushinteger(L, (port - 1) * 16 + channel);
+    return 1;
+}
+
+// MIDI.chord(notes, velocity, [duration = 0], [channel = 1])
+// notes: string of note names separated by spaces or commas (e.g. "C3 E3 G3"), or a table of
+// note names and/or numbers
+// velocity: integer 1-127
+// duration (optional): integer, 0 for notes without a duration (see MIDI.noteonwithduration())
+// channel (optional): integer 1-16, 17-32 for the second port etc. (see MIDI.channel())
+// Queues a note on command for every note of the chord
+static int midi_chord(lua_State *L)
+{
+    emstContext *ctx = contextArg(L);
+    int args = lua_gettop(L);
+    if ((args < 2) || (args > 4)) {
+        return luaL_error(L, "Invalid number of arguments to MIDI.chord()");
+    }
+    
+    if (!initcheck(ctx)) {
+        return luaL_error(L, "Must call MIDI.init() before MIDI.chord()");
+    }
+    
+    int notes[128];
+    int count = readChord(L, 1, notes, "MIDI.chord()");
+    
+    int vel = luaL_checkinteger(L, 2) & 0x7F; // keep velocity in 0-127 range
+    // 0 velocity = no-op (might otherwise act as a note off)
+    if (vel == 0) {
+        return 0;
+    }
+    
+    int duration = 0;
+    if (args >= 3) {
+        duration = luaL_checkinteger(L, 3);
+        if (duration < 0) {
+            duration = 0;
+        }
+    }
+    
+    int channel = 0;
+    if (args == 4) {
+        channel = luaL_checkinteger(L, 4);
+        // Channel argument is in range 1-16 (17-32 for the second port etc.), subtract 1 for zero-indexed channel.
+        // Argument of '0' will still go to zero-indexed channel 0.
+        channel--;
+        if (channel < 0) channel = 0;
+        if (channel >= ctx->channelCount) channel = ctx->channelCount - 1;
+    }
+    
+    if (!reserveCommands(ctx, ctx->commandQueueIndex + count)) {
+        return luaL_error(L, "Not enough memory to queue MIDI command, call MIDI.sendmessages() more often");
+    }
+    for (int i = 0; i < count; i++) {
+        if (duration > 0) {
+            queueCommand(ctx, L, makeCommand(kNoteOnWithDuration, channel, notes[i], vel, duration));
+        } else {
+            queueCommand(ctx, L, makeCommand(kNoteOn, channel, notes[i], vel, 0));
+        }
+    }
+    
+    return 0;
+}
+
+// MIDI.noteon(notenumber, velocity, [channel = 1])
+// notenumber: integer 0-127
+// velocity: integer 1-127
+// channel (optional): integer 1-16, 17-32 for the second port etc. (see MIDI.channel())
+static int midi_noteon(lua_State *L)
+{
+    emstContext *ctx = contextArg(L);
+    int args = lua_gettop(L);
+    if ((args < 2) || (args > 3)) {
+        return luaL_error(L, "Invalid number of arguments to MIDI.noteon()");
+    }
+    
+    if (!initcheck(ctx)) {
+        return luaL_error(L, "Must call MIDI.init() before MIDI.noteon()");
+    }
+    
+    int note = luaL_checkinteger(L, 1) & 0x7F; // keep note in 0-127 range
+    int vel = luaL_checkinteger(L, 2) & 0x7F; // keep velocity in 0-127 range
+    // 0 velocity = no-op (might otherwise act as a note off)
+    if (vel == 0) {
+        return 0;
+    }
+    
+    int channel = 0;
+    if (args == 3) {
+        channel = luaL_checkinteger(L, 3);
+        // Channel argument is in range 1-16 (17-32 for the second port etc.), subtract 1 for zero-indexed channel.
+        // Argument of '0' will still go to zero-indexed channel 0.
+        channel--;
+        if (channel < 0) channel = 0;
+        if (channel >= ctx->channelCount) channel = ctx->channelCount - 1;
+    }
+    
+    queueCommand(ctx, L, makeCommand(kNoteOn, channel, note, vel, 0));
+        
+    return 0;
+}
+
+// MIDI.noteoff(notenumber, [channel = 1])
+// notenumber: integer 0-127
+// channel (optional): integer 1-16, 17-32 for the second port etc. (see MIDI.channel())
+static int midi_noteoff(lua_State *L)
+{
+    emstContext *ctx = contextArg(L);
+    int args = lua_gettop(L);
+    if ((args < 1) || (args > 2)) {
+        return luaL_error(L, "Invalid number of arguments to MIDI.noteoff()");
+    }
+    
+    if (!initcheck(ctx)) {
+        return luaL_error(L, "Must call MIDI.init() before MIDI.noteoff()");
+    }
+    
+    int note = luaL_checkinteger(L, 1) & 0x7F; // keeps note in 0-127 range
+    
+    int channel = 0;
+    if (args == 2) {
+        channel = luaL_checkinteger(L, 2);
+        // Channel argument is in range 1-16 (17-32 for the second port etc.), subtract 1 for zero-indexed channel.
+        // Argument of '0' will still go to zero-indexed channel 0.
+        channel--;
+        if (channel < 0) channel = 0;
+        if (channel >= ctx->channelCount) channel = ctx->channelCount - 1;
+    }
+    
+    queueCommand(ctx, L, makeCommand(kNoteOff, channel, note, 0, 0));
+    
+    return 0;
+}
+
+// MIDI.noteonwithduration(notenumber, velocity, duration, [channel = 1])
+// notenumber: integer 0-127
+// velocity: integer 1-127
+// duration: integer in 60ths of a second (or a user-set value)
+// channel (optional): integer 1-16, 17-32 for the second port etc. (see MIDI.channel())
+static int midi_noteonwithduration(lua_State *L)
+{
+    emstContext *ctx = contextArg(L);
+    int args = lua_gettop(L);
+    if ((args < 3) || (args > 4)) {
+        return luaL_error(L, "Invalid number of arguments to MIDI.noteonwithduration()");
+    }
+    
+    if (!initcheck(ctx)) {
+        return luaL_error(L, "Must call MIDI.init() before MIDI.noteonwithduration()");
+    }
+    
+    int note = luaL_checkinteger(L, 1) & 0x7F; // keeps note in 0-127 range
+    int vel = luaL_checkinteger(L, 2) & 0x7F; // keeps velocity in 0-127 range
+    // do nothing for 0 velocity
+        if (vel == 0) {
+        return 0;
+    }
+    int duration = luaL_checkinteger(L, 3);
+    // do nothing for 0 or negative duration
+    if (!(duration > 0)) {
+        return 0;
+    }
+    
+    int channel = 0;
+    if (args == 4) {
+        channel = luaL_checkinteger(L, 4);
+        // Channel argument is in range 1-16 (17-32 for the second port etc.), subtract 1 for zero-indexed channel.
+        // Argument of '0' will still go to zero-indexed channel 0.
+        channel--;
+        if (channel < 0) channel = 0;
+        if (channel >= ctx->channelCount) channel = ctx->channelCount - 1;
+    }
+    
+    queueCommand(ctx, L, makeCommand(kNoteOnWithDuration, channel, note, vel, duration));
+    
+    return 0;
+}
+
+// MIDI.settempo(bpm, [ppq = 4])
+// bpm: number, tempo in quarter notes per minute
+// ppq (optional): integer, grid ticks per quarter note
+// Sets the tempo of the beat grid used by MIDI.noteonquantized(). Notes already waiting for the
+// grid are sent at the same position in the bar, at the new tempo.
+static int midi_settempo(lua_State *L)
+{
+    emstContext *ctx = contextArg(L);
+    int args = lua_gettop(L);
+    if ((args < 1) || (args > 2)) {
+        return luaL_error(L, "Invalid number of arguments to MIDI.settempo()");
+    }
+    
+    if (!initcheck(ctx)) {
+        return luaL_error(L, "Must call MIDI.init() before MIDI.settempo()");
+    }
+    
+    double bpm = luaL_checknumber(L, 1);
+    if (!(bpm > 0)) {
+        return luaL_error(L, "Invalid tempo passed to MIDI.settempo()");
+    }
+    int ppq = DEFAULT_PPQ;
+    if (args == 2) {
+        ppq = luaL_checkinteger(L, 2);
+        if (ppq < 1) {
+            return luaL_error(L, "Invalid ppq passed to MIDI.settempo()");
+        }
+    }
+    
+    setTempo(ctx, bpm, ppq);
+    
+    return 0;
+}
+
+// MIDI.noteonquantized(notenumber, velocity, duration, [channel = 1], [grid = 1])
+// notenumber: integer 0-127
+// velocity: integer 1-127
+// duration: integer in 60ths of a second (or a user-set value)
+// channel (optional): integer 1-16, 17-32 for the second port etc. (see MIDI.channel())
+// grid (optional): integer, the note starts on the next multiple of this many grid ticks
+// Unlike the other functions, the note doesn't wait for MIDI.sendmessages(): it waits for the
+// next grid boundary (see MIDI.settempo()), and is sent by the note scheduler exactly then.
+// Playing the same note on the same channel again for the same grid tick replaces it.
+static int midi_noteonquantized(lua_State *L)
+{
+    emstContext *ctx = contextArg(L);
+    int args = lua_gettop(L);
+    if ((args < 3) || (args > 5)) {
+        return luaL_error(L, "Invalid number of arguments to MIDI.noteonquantized()");
+    }
+    
+    if (!initcheck(ctx)) {
+        return luaL_error(L, "Must call MIDI.init() before MIDI.noteonquantized()");
+    }
+    
+    int note = luaL_checkinteger(L, 1) & 0x7F; // keeps note in 0-127 range
+    int vel = luaL_checkinteger(L, 2) & 0x7F; // keeps velocity in 0-127 range
+    // do nothing for 0 velocity
+    if (vel == 0) {
+        return 0;
+    }
+    int duration = luaL_checkinteger(L, 3);
+    // do nothing for 0 or negative duration
+    if (!(duration > 0)) {
+        return 0;
+    }
+    
+    int channel = 0;
+    if ((args >= 4) && !lua_isnil(L, 4)) {
+        channel = luaL_checkinteger(L, 4);
+        // Channel argument is in range 1-16 (17-32 for the second port etc.), subtract 1 for zero-indexed channel.
+        channel--;
+        if (channel < 0) channel = 0;
+        if (channel >= ctx->channelCount) channel = ctx->channelCount - 1;
+    }
+    
+    int grid = 1;
+    if (args == 5) {
+        grid = luaL_checkinteger(L, 5);
+        if (grid < 1) {
+            return luaL_error(L, "Invalid grid passed to MIDI.noteonquantized()");
+        }
+    }
+    
+    if (!quantizeNoteOn(ctx, makeCommand(kNoteOnWithDuration, channel, note, vel, duration), grid)) {
+        return luaL_error(L, "Out of memory in MIDI.noteonquantized()");
+    }
+    
+    return 0;
+}
+
+// MIDI.CC(CC, value, [channel = 1])
+// CC: integer 0-120
+// value: integer 0-127
+// channel (optional): integer 1-16, 17-32 for the second port etc. (see MIDI.channel())
+static int midi_CC(lua_State *L)
+{
+    emstContext *ctx = contextArg(L);
+    int args = lua_gettop(L);
+    if ((args < 2) || (args > 3)) {
+        return luaL_error(L, "Invalid number of arguments to MIDI.CC()");
+    }
+    
+    if (!initcheck(ctx)) {
+        return luaL_error(L, "Must call MIDI.init() before MIDI.CC()");
+    }
+    
+    int CC = luaL_checkinteger(L, 1); 
+    // keep CC in 0-119 range
+    if (CC < 0) {
+        CC = 0;
+    }
+    if (CC > 119) {
+        CC = 119;
+    }
+    
+    int value = luaL_checkinteger(L, 2) & 0x7F; // keeps value in 0-127 range
+    int channel = 0;
+    
+    if (args == 3) {
+        channel = luaL_checkinteger(L,3);
+        // Channel argument is in range 1-16 (17-32 for the second port etc.), subtract 1 for zero-indexed channel.
+        // Argument of '0' will still go to zero-indexed channel 0.
+        channel--;
+        if (channel < 0) channel = 0;
+        if (channel >= ctx->channelCount) channel = ctx->channelCount - 1;
+    }
+    
+    queueCommand(ctx, L, makeCommand(kCC, channel, CC, value, 0));
+    
+    return 0;
+}
+
+// Converts a bend in the range -1 to 1 to a 14 bit pitch bend value
+static int pitchBendValue(float bend)
+{
+    if (bend > 1.0) {
+        bend = 1.0;
+    }
+    if (bend < -1.0) {
+        bend = -1.0;
+    }
+    // pitch value is a 14 bit value, center is 0x2000 = 8192 = (1 << 13)
+    int delta14b = roundf(8191.0 * bend);
+    return 8192 + delta14b;
+}
+
+// MIDI.pitchbend(bend, [channel = 1])
+// bend: float, -1 to 1 (min and max pitch bend, respectively)
+// channel (optional): integer 1-16, 17-32 for the second port etc. (see MIDI.channel())
+static int midi_pitchbend(lua_State *L)
+{
+    emstContext *ctx = contextArg(L);
+    int args = lua_gettop(L);
+    if ((args < 1) || (args > 2)) {
+        return luaL_error(L, "Invalid number of arguments to MIDI.pitchbend()");
+    }
+    
+    if (!initcheck(ctx)) {
+        return luaL_error(L, "Must call MIDI.init() before MIDI.pitchbend()");
+    }
+    
+    float value = luaL_checknumber(L, 1);
+    
+    int channel = 0;
+    if (args == 2) {
+        channel = luaL_checkinteger(L, 2);
+        // Channel argument is in range 1-16 (17-32 for the second port etc.), subtract 1 for zero-indexed channel.
+        // Argument of '0' will still go to zero-indexed channel 0.
+        channel--;
+        if (channel < 0) channel = 0;
+        if (channel >= ctx->channelCount) channel = ctx->channelCount - 1;
+    }
+    
+    int pbvalue14b = pitchBendValue(value);
+    int pbvalueL7b = (pbvalue14b & 0x7F);
+    int pbvalueM7b = ((pbvalue14b >> 7) & 0x7F);
+    
+    queueCommand(ctx, L, makeCommand(kPitchBend, channel, pbvalueM7b, pbvalueL7b, 0));
+    
+    return 0;
+}
+
+// MIDI.allnotesoff([channel = 1])
+// channel (optional): integer 1-16, 17-32 for the second port etc. (see MIDI.channel())
+static int midi_allnotesoff(lua_State *L)
+{
+    emstContext *ctx = contextArg(L);
+    int args = lua_gettop(L);
+    if (args > 1) {
+        return luaL_error(L, "Invalid number of arguments to MIDI.allnotesoff()");
+    }
+    
+    if (!initcheck(ctx)) {
+        return luaL_error(L, "Must call MIDI.init() before MIDI.allnotesoff()");
+    }
+    
+    int channel = 0;
+    if (args == 1) {
+        channel = luaL_checkinteger(L, 1);
+        // Channel argument is in range 1-16 (17-32 for the second port etc.), subtract 1 for zero-indexed channel.
+        // Argument of '0' will still go to zero-indexed channel 0.
+        channel--;
+        if (channel < 0) channel = 0;
+        if (channel >= ctx->channelCount) channel = ctx->channelCount - 1;
+    }
+    
+    queueCommand(ctx, L, makeCommand(kResetNotes, channel, 0, 0, 0));
+        
+    return 0;
+}
+
+// MIDI.panic()
+// No arguments
+// Turns off every note playing on any channel
+static int midi_panic(lua_State *L)
+{
+    emstContext *ctx = contextArg(L);
+    int args = lua_gettop(L);
+    if (args > 0) {
+        return luaL_error(L, "Invalid number of arguments to MIDI.panic()");
+    }
+    
+    if (!initcheck(ctx)) {
+        return luaL_error(L, "Must call MIDI.init() before MIDI.panic()");
+    }
+    
+    queueCommand(ctx, L, makeCommand(kResetAllNotes, 0, 0, 0, 0));
+    
+    return 0;
+}
+
+// Event kinds for MIDI.queue(), available to scripts as MIDI.NOTEON etc.
+typedef enum {
+    kEventNoteOn = 1,
+    kEventNoteOff,
+    kEventNoteOnWithDuration,
+    kEventCC,
+    kEventPitchBend,
+    kEventAllNotesOff,
+    kEventPanic
+} eventKind;
+
+static const struct {
+    const char *name;
+    eventKind kind;
+} kEventKinds[] = {
+    {"NOTEON", kEventNoteOn},
+    {"NOTEOFF", kEventNoteOff},
+    {"NOTEONWITHDURATION", kEventNoteOnWithDuration},
+    {"CONTROLCHANGE", kEventCC}, // not "CC", that would replace MIDI.CC()
+    {"PITCHBEND", kEventPitchBend},
+    {"ALLNOTESOFF", kEventAllNotesOff},
+    {"PANIC", kEventPanic},
+    {NULL, 0}
+};
+
+#define EVENT_SIZE 6 // kind, channel, data1, data2, data3 (low byte), data3 (high byte)
+
+// MIDI.queue(events)
+// events: string of packed events, 6 bytes each: kind, channel, data1, data2, data3 (16 bits, low byte first)
+// kind: MIDI.NOTEON (data1 = notenumber, data2 = velocity), MIDI.NOTEOFF (data1 = notenumber),
+// MIDI.NOTEONWITHDURATION (data1 = notenumber, data2 = velocity, data3 = duration),
+// MIDI.CONTROLCHANGE (data1 = CC, data2 = value), MIDI.PITCHBEND (data3 = 14 bit bend, 8192 is centered),
+// MIDI.ALLNOTESOFF, MIDI.PANIC
+// channel: 0-15, 16-31 for the second port etc. (zero-based so that every channel fits in a byte,
+// ignored by MIDI.PANIC), unused data fields should be 0
+// Same as calling the matching functions for each event, but in a single call that reads the
+// events straight out of the string. Either all of the events are queued, or none of them are
+// (if one of them is invalid).
+static int midi_queue(lua_State *L)
+{
+    emstContext *ctx = contextArg(L);
+    int args = lua_gettop(L);
+    if (args != 1) {
+        return luaL_error(L, "Invalid number of arguments to MIDI.queue()");
+    }
+    
+    if (!initcheck(ctx)) {
+        return luaL_error(L, "Must call MIDI.init() before MIDI.queue()");
+    }
+    
+    size_t length;
+    const uint8_t *events = (const uint8_t *)luaL_checklstring(L, 1, &length);
+    if (length % EVENT_SIZE != 0) {
+        return luaL_error(L, "MIDI.queue() needs %d bytes per event", EVENT_SIZE);
+    }
+    size_t count = length / EVENT_SIZE;
+    
+    // make room for every event up front, they're only added to the queue at the end
+    if ((count > CMD_MAX) || !reserveCommands(ctx, ctx->commandQueueIndex + (uint32_t)count)) {
+        return luaL_error(L, "Not enough memory to queue MIDI commands, call MIDI.sendmessages() more often");
+    }
+    
+    int queued = ctx->commandQueueIndex;
+    for (size_t i = 0; i < count; i++) {
+        const uint8_t *event = events + i * EVENT_SIZE;
+        int channel = event[1];
+        if (channel >= ctx->channelCount) channel = ctx->channelCount - 1;
+        int data1 = event[2];
+        int data2 = event[3];
+        int data3 = event[4] | (event[5] << 8);
+        
+        // same checks as the matching API calls
+        command c;
+        switch (event[0]) {
+            case kEventNoteOn:
+                if ((data2 & 0x7F) == 0) {
+                    continue;
+                }
+                c = makeCommand(kNoteOn, channel, data1 & 0x7F, data2 & 0x7F, 0);
+                break;
+            case kEventNoteOff:
+                c = makeCommand(kNoteOff, channel, data1 & 0x7F, 0, 0);
+                break;
+            case kEventNoteOnWithDuration:
+                if (((data2 & 0x7F) == 0) || (data3 == 0)) {
+                    continue;
+                }
+                c = makeCommand(kNoteOnWithDuration, channel, data1 & 0x7F, data2 & 0x7F, data3);
+                break;
+            case kEventCC:
+                if (data1 > 119) data1 = 119;
+                c = makeCommand(kCC, channel, data1, data2 & 0x7F, 0);
+                break;
+            case kEventPitchBend:
+                if (data3 > 0x3FFF) data3 = 0x3FFF;
+                c = makeCommand(kPitchBend, channel, (data3 >> 7) & 0x7F, data3 & 0x7F, 0);
+                break;
+            case kEventAllNotesOff:
+                c = makeCommand(kResetNotes, channel, 0, 0, 0);
+                break;
+            case kEventPanic:
+                c = makeCommand(kResetAllNotes, 0, 0, 0, 0);
+                break;
+            default:
+                return luaL_error(L, "MIDI.queue() event %d: unknown kind %d", (int)i + 1, event[0]);
+        }
+        ctx->commandQueue[queued] = c;
+        queued++;
+    }
+    ctx->commandQueueIndex = queued;
+    
+    return 0;
+}
+
+// Sends everything queued since the last flush, see MIDI.sendmessages()
+static int sendMessages(emstContext *ctx)
+{
+    uint64_t flushStart = currentTimeNs();
+    int deduped = 0;
+    
+    // Used to remove redundant (possibly contradictory) events: one bit per MIDI channel, for
+    // each port
+    uint16_t noteOns[MAX_PORTS][128];
+    uint16_t noteOffs[MAX_PORTS][128];
+    uint16_t CCs[MAX_PORTS][128];
+    
+    memset(noteOns, 0, ctx->portCount * sizeof(noteOns[0]));
+    memset(noteOffs, 0, ctx->portCount * sizeof(noteOffs[0]));
+    memset(CCs, 0, ctx->portCount * sizeof(CCs[0]));
+    uint16_t notesReset[MAX_PORTS] = {0}; // remove all note on commands before reset notes command
+    uint16_t pitchBends[MAX_PORTS] = {0}; // remove all but the last pitch bend command for each channel
+    
+    // surviving commands are moved to the end of the queue, starting at this index
+    int firstCommand = ctx->commandQueueIndex;
+    
+    // 1: Run through backwards and remove superfluous commands.
+    // Everything is done in this one pass: the remaining commands are compacted towards the end
+    // of commandQueue as they're found (in their original order), so sending them only needs to
+    // look at commands that are actually sent.
+    for (int i = ctx->commandQueueIndex - 1; i >= 0; i--) {
+        int ch = cmdChannel(ctx->commandQueue[i]);
+        int port = CHANNEL_PORT(ch);
+        uint16_t bit = 1 << CHANNEL_MIDI(ch);
+        switch(cmdType(ctx->commandQueue[i])) {
+            case kNoteOn:
+            case kNoteOnWithDuration:
+            {
+                int note = cmdData1(ctx->commandQueue[i]);
+                if (noteOffs[port][note] & bit) {
+                    // note off exists later in queue, remove me
+                    ctx->commandQueue[i] = cmdWithType(ctx->commandQueue[i], kInvalid);
+                    deduped++;
+                    break;
+                }
+                if (noteOns[port][note] & bit) {
+                    // note on already exists later in the queue, remove me
+                    ctx->commandQueue[i] = cmdWithType(ctx->commandQueue[i], kInvalid);
+                    deduped++;
+                    break;
+                }
+                if (notesReset[port] & bit) {
+                    // reset notes command exists later in the queue, remove me
+                    ctx->commandQueue[i] = cmdWithType(ctx->commandQueue[i], kInvalid);
+                    deduped++;
+                    break;
+                }
+                noteOns[port][note] |= bit;
+                break;
+            }
+            case kNoteOff:
+            {
+                int note = cmdData1(ctx->commandQueue[i]);
+                noteOffs[port][note] |= bit;
+                break;
+            }
+            case kCC:
+            {
+                int cc = cmdData1(ctx->commandQueue[i]);
+                if (CCs[port][cc] & bit) {
+                    ctx->commandQueue[i] = cmdWithType(ctx->commandQueue[i], kInvalid);
+                    deduped++;
+                    break;
+                }
+                CCs[port][cc] |= bit;
+                break;
+            }
+            case kPitchBend:
+                if (pitchBends[port] & bit) {
+                    ctx->commandQueue[i] = cmdWithType(ctx->commandQueue[i], kInvalid);
+                    deduped++;
+                    break;
+                }
+                pitchBends[port] |= bit;
+                break;
+            case kResetNotes:
+                notesReset[port] |= bit;
+                break;
+            case kResetAllNotes:
+                for (int p = 0; p < ctx->portCount; p++) {
+                    notesReset[p] = 0xFFFF;
+                }
+                break;
+            default:
+                break;
+        }
+        if (cmdType(ctx->commandQueue[i]) != kInvalid) {
+            firstCommand--;
+            ctx->commandQueue[firstCommand] = ctx->commandQueue[i];
+        }
+    }
+    
+    // 2. Send the remaining commands, right away with flushBatch, or in lookahead mode by handing
+    // them to the note scheduler, which sends them at the frame's target time.
+    // On refresh frames, controller messages are sent even if the value hasn't changed.
+    ctx->framesSinceRefresh++;
+    bool controllerRefresh = (ctx->resync_interval > 0) && (ctx->framesSinceRefresh >= ctx->resync_interval);
+    if (controllerRefresh) {
+        ctx->framesSinceRefresh = 0;
+    }
+    int submissions;
+    int sent;
+    int delayed;
+    if (ctx->lookahead > 0) {
+        // messages are only known once the frame goes out, so the commands are counted instead
+        uint64_t target = lookaheadTarget(ctx);
+        submissions = lookaheadPublish(ctx, target, &ctx->commandQueue[firstCommand], ctx->commandQueueIndex - firstCommand,
+                                       controllerRefresh, ctx->resyncPending);
+        sent = ctx->commandQueueIndex - firstCommand;
+        delayed = 0;
+    } else {
+        // The clock is read once: every timed event of the frame (note offs, delayed note ons) is
+        // scheduled relative to the same base time
+        ctx->flushBatch.baseTime = schedulerNowNs(ctx);
+        ctx->flushBatch.controllerRefresh = controllerRefresh;
+        submissions = sendFrame(&ctx->flushBatch, &ctx->commandQueue[firstCommand], ctx->commandQueueIndex - firstCommand,
+                                ctx->delayedCommands, ctx->resyncPending, &sent, &delayed);
+    }
+    ctx->resyncPending = false;
+    
+    ctx->lastFlushStats.frames = 1;
+    ctx->lastFlushStats.queued = ctx->commandQueueIndex;
+    ctx->lastFlushStats.deduped = deduped;
+    ctx->lastFlushStats.sent = sent;
+    ctx->lastFlushStats.delayed = delayed;
+    ctx->lastFlushStats.flushTime = currentTimeNs() - flushStart;
+    ctx->lastFlushStats.maxFlushTime = ctx->lastFlushStats.flushTime;
+    
+    ctx->totalFlushStats.frames++;
+    ctx->totalFlushStats.queued += ctx->lastFlushStats.queued;
+    ctx->totalFlushStats.deduped += ctx->lastFlushStats.deduped;
+    ctx->totalFlushStats.sent += ctx->lastFlushStats.sent;
+    ctx->totalFlushStats.delayed += ctx->lastFlushStats.delayed;
+    ctx->totalFlushStats.flushTime += ctx->lastFlushStats.flushTime;
+    if (ctx->lastFlushStats.flushTime > ctx->totalFlushStats.maxFlushTime) {
+        ctx->totalFlushStats.maxFlushTime = ctx->lastFlushStats.flushTime;
+    }
+    
+    if (ctx->statsFile != NULL) {
+        ctx->framesSinceStatsDump++;
+        if (ctx->framesSinceStatsDump >= ctx->stats_interval) {
+            writeStats(ctx, ctx->statsFile);
+            ctx->framesSinceStatsDump = 0;
+        }
+    }
+    
+    ctx->commandQueueIndex = 0;
+
+    return submissions;
+}
+
+// MIDI.sendmessages()
+// No arguments
+// Returns the number of batches handed to the backend for this flush (usually 1, or 2 if
+// there were delayed note-ons and no note-on delay, 0 if nothing was sent)
+static int midi_sendMessages(lua_State *L)
+{
+    emstContext *ctx = contextArg(L);
+    if (!initcheck(ctx)) {
+        return luaL_error(L, "Must call MIDI.init() before MIDI.sendmessages()");
+    }
+    
+    lua_pushinteger(L, sendMessages(ctx));
+    return 1;
+}
+
+// Sets table[name] = value for the table at the top of the stack
+static void setStatsField(lua_State *L, const char *name, uint64_t value)
+{
+    lua_pushnumber(L, (lua_Number)value);
+    lua_setfield(L, -2, name);
+}
+
+// Pushes a table with the counters in stats
+static void pushFlushStats(lua_State *L, const flushStatistics *stats)
+{
+    lua_createtable(L, 0, 8);
+    setStatsField(L, "frames", stats->frames);
+    setStatsField(L, "queued", stats->queued);
+    setStatsField(L, "deduped", stats->deduped);
+    setStatsField(L, "sent", stats->sent);
+    setStatsField(L, "delayed", stats->delayed);
+    setStatsField(L, "flushtime", stats->flushTime / 1000);
+    setStatsField(L, "maxflushtime", stats->maxFlushTime / 1000);
+    setStatsField(L, "avgflushtime", (stats->frames > 0) ? stats->flushTime / stats->frames / 1000 : 0);
+}
+
+// MIDI.stats([reset])
+// reset (optional): boolean, reset the totals and the latency histogram after reading them
+// Returns a table with statistics about the last MIDI.sendmessages() call, the totals since
+// MIDI.init() (or the last reset), the number of note offs waiting to be sent, and
+// percentiles of how late the note scheduler sent note offs. Times are in µs.
+static int midi_stats(lua_State *L)
+{
+    emstContext *ctx = contextArg(L);
+    int args = lua_gettop(L);
+    if (args > 1) {
+        return luaL_error(L, "Invalid number of arguments to MIDI.stats()");
+    }
+    
+    if (!initcheck(ctx)) {
+        return luaL_error(L, "Must call MIDI.init() before MIDI.stats()");
+    }
+    
+    lua_createtable(L, 0, 4);
+    pushFlushStats(L, &ctx->lastFlushStats);
+    lua_setfield(L, -2, "last");
+    pushFlushStats(L, &ctx->totalFlushStats);
+    lua_setfield(L, -2, "total");
+    setStatsField(L, "pendingnoteoffs", scheduledNoteOffCount(ctx));
+    
+    lua_createtable(L, 0, 6);
+    setStatsField(L, "count", atomic_load(&ctx->noteOffLatency.total));
+    setStatsField(L, "p50", histogramPercentile(&ctx->noteOffLatency, 50));
+    setStatsField(L, "p90", histogramPercentile(&ctx->noteOffLatency, 90));
+    setStatsField(L, "p99", histogramPercentile(&ctx->noteOffLatency, 99));
+    setStatsField(L, "p999", histogramPercentile(&ctx->noteOffLatency, 99.9));
+    setStatsField(L, "max", atomic_load(&ctx->noteOffLatency.max));
+    lua_setfield(L, -2, "noteofflatency");
+    
+    if ((args == 1) && lua_toboolean(L, 1)) {
+        memset(&ctx->totalFlushStats, 0, sizeof(ctx->totalFlushStats));
+        histogramReset(&ctx->noteOffLatency);
+    }
+    
+    return 1;
+}
+
+// MIDI.configurestats(path, [interval = 600])
+// path: string, file to append statistics to, or nil to stop writing them
+// interval (optional): integer, number of MIDI.sendmessages() calls between lines
+// Every interval frames, a line with the totals from MIDI.stats() is appended to the file.
+static int midi_configurestats(lua_State *L)
+{
+    emstContext *ctx = contextArg(L);
+    int args = lua_gettop(L);
+    if ((args < 1) || (args > 2)) {
+        return luaL_error(L, "Invalid number of arguments to MIDI.configurestats()");
+    }
+    
+    if (ctx->statsFile != NULL) {
+        fclose(ctx->statsFile);
+        ctx->statsFile = NULL;
+    }
+    
+    if (lua_isnil(L, 1)) {
+        return 0;
+    }
+    
+    const char *path = luaL_checkstring(L, 1);
+    int interval = DEFAULT_STATS_INTERVAL;
+    if (args == 2) {
+        interval = luaL_checkinteger(L, 2);
+        if (interval < 1) {
+            interval = 1;
+        }
+    }
+    
+    ctx->statsFile = fopen(path, "a");
+    if (ctx->statsFile == NULL) {
+        return luaL_error(L, "MIDI.configurestats() couldn't open %s", path);
+    }
+    ctx->stats_interval = interval;
+    ctx->framesSinceStatsDump = 0;
+    
+    return 0;
+}
+
+// MIDI.record(path)
+// path: string, Standard MIDI File to record to, or nil to stop recording
+// Records every MIDI message sent from now on (including note offs and delayed note ons sent
+// later by the note scheduler), with one track per channel, until MIDI.record() is called
+// again. The file is only complete once recording has stopped.
+static int midi_record(lua_State *L)
+{
+    emstContext *ctx = contextArg(L);
+    int args = lua_gettop(L);
+    if (args != 1) {
+        return luaL_error(L, "Invalid number of arguments to MIDI.record()");
+    }
+    
+    if (!initcheck(ctx)) {
+        return luaL_error(L, "Must call MIDI.init() before MIDI.record()");
+    }
+    
+    if ((ctx->recorderFile != NULL) && !recorderStop(ctx)) {
+        return luaL_error(L, "MIDI.record() couldn't write the whole recording");
+    }
+    
+    if (lua_isnil(L, 1)) {
+        return 0;
+    }
+    
+    const char *path = luaL_checkstring(L, 1);
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        return luaL_error(L, "MIDI.record() couldn't open %s", path);
+    }
+    if (!recorderStart(ctx, file)) {
+        fclose(file);
+        return luaL_error(L, "MIDI.record() couldn't start the recorder");
+    }
+    
+    static bool stopAtExitRegistered = false;
+    if (!stopAtExitRegistered) {
+        atexit(recorderStopAtExit);
+        stopAtExitRegistered = true;
+    }
+    
+    return 0;
+}
+
+// MIDI.advanceclock(ms)
+// ms: number, how far to move the clock forward, in milliseconds
+// For test harnesses: the first call stops timed events (note offs for notes with a duration,
+// delayed note ons) from being sent in real time. From then on they're only sent by this
+// function, as the clock passes their time, so scripts can be replayed faster than real time
+// with the same results every time.
+static int midi_advanceclock(lua_State *L)
+{
+    emstContext *ctx = contextArg(L);
+    int args = lua_gettop(L);
+    if (args != 1) {
+        return luaL_error(L, "Invalid number of arguments to MIDI.advanceclock()");
+    }
+    
+    if (!initcheck(ctx)) {
+        return luaL_error(L, "Must call MIDI.init() before MIDI.advanceclock()");
+    }
+    
+    double ms = luaL_checknumber(L, 1);
+    if (ms < 0) {
+        return luaL_error(L, "The clock can't go backwards in MIDI.advanceclock()");
+    }
+    advanceSchedulerClock(ctx, ms);
+    
+    return 0;
+}
+
+// MIDI.drain([port])
+// port (optional): integer, which port to read, 1 to the number of ports (default 1)
+// Only for the ringbuffer backend: returns every MIDI message sent to the port since the last
+// call, as a string of raw MIDI bytes, so test harnesses can check and time the output.
+static int midi_drain(lua_State *L)
+{
+    emstContext *ctx = contextArg(L);
+    int args = lua_gettop(L);
+    if (args > 1) {
+        return luaL_error(L, "Invalid number of arguments to MIDI.drain()");
+    }
+    
+    if (!initcheck(ctx)) {
+        return luaL_error(L, "Must call MIDI.init() before MIDI.drain()");
+    }
+    
+    if (ctx->transport != findBackend("ringbuffer")) {
+        return luaL_error(L, "MIDI.drain() only works with the ringbuffer backend");
+    }
+    
+    int port = luaL_optinteger(L, 1, 1) - 1;
+    if ((port < 0) || (port >= ctx->portCount)) {
+        return luaL_error(L, "No port %d in MIDI.drain()", port + 1);
+    }
+    byteRing *ring = &ctx->ports[port].ring;
+    
+    luaL_Buffer buffer;
+    luaL_buffinit(L, &buffer);
+    size_t length;
+    while ((length = ringPeek(ring)) > 0) {
+        if (length > ctx->drainRecordSize) {
+            uint8_t *newRecord = realloc(ctx->drainRecord, length);
+            if (newRecord == NULL) {
+                return luaL_error(L, "Out of memory in MIDI.drain()");
+            }
+            ctx->drainRecord = newRecord;
+            ctx->drainRecordSize = length;
+        }
+        ringPop(ring, ctx->drainRecord);
+        luaL_addlstring(&buffer, (const char *)ctx->drainRecord, length);
+    }
+    luaL_pushresult(&buffer);
+    
+    return 1;
+}
+
+static const struct luaL_reg kMidilib[] = {
+    {"init", midi_init},
+    {"open", midi_open},
+    {"configuretiming", midi_configuretiming},
+    {"configureoutputthread", midi_configureoutputthread},
+    {"configurelookahead", midi_configurelookahead},
+    {"configureresync", midi_configureresync},
+    {"configureosc", midi_configureosc},
+    {"reserve", midi_reserve},
+    {"notenumber", midi_noteNumber},
+    {"notenumbers", midi_noteNumbers},
+    {"channel", midi_channel},
+    {"chord", midi_chord},
+    {"noteon", midi_noteon},
+    {"noteoff", midi_noteoff},
+    {"noteonwithduration", midi_noteonwithduration},
+    {"settempo", midi_settempo},
+    {"noteonquantized", midi_noteonquantized},
+    {"CC", midi_CC},
+    {"pitchbend", midi_pitchbend},
+    {"allnotesoff", midi_allnotesoff},
+    {"panic", midi_panic},
+    {"resync", midi_resync},
+    {"queue", midi_queue},
+    {"sendmessages", midi_sendMessages},
+    {"stats", midi_stats},
+    {"configurestats", midi_configurestats},
+    {"record", midi_record},
+    {"advanceclock", midi_advanceclock},
+    {"drain", midi_drain},
+    {NULL,NULL}
+};
+
+// Lua unloads the module when the state that loaded it is closed (e.g. when a script is stopped),
+// but the note scheduler and the other threads keep running, so the module has to stay loaded
+// until the process exits. Opening it again with RTLD_NODELETE makes sure it does.
+static void keepModuleLoaded(void)
+{
+    static bool kept = false;
+    Dl_info info;
+    if (!kept && dladdr((void *)keepModuleLoaded, &info) && (info.dli_fname != NULL)) {
+        kept = (dlopen(info.dli_fname, RTLD_NOW | RTLD_NODELETE) != NULL);
+    }
+}
+
+// Functions that don't work on a context, so they aren't methods of MIDI.open()'s objects
+static bool isContextFree(lua_CFunction f)
+{
+    return (f == midi_init) || (f == midi_open) || (f == midi_noteNumber) || (f == midi_noteNumbers) ||
+        (f == midi_channel);
+}
+
+// The metatable of MIDI.open()'s objects: every function in kMidilib that works on a context,
+// as a closure with a true upvalue (see contextArg()), plus close()
+static void registerMethods(lua_State *L)
+{
+  luaL_newmetatable(L, CONTEXT_METATABLE);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  for (int i = 0; kMidilib[i].name != NULL; i++) {
+    if (!isContextFree(kMidilib[i].func)) {
+      lua_pushboolean(L, 1);
+      lua_pushcclosure(L, kMidilib[i].func, 1);
+      lua_setfield(L, -2, kMidilib[i].name);
+    }
+  }
+  lua_pushcfunction(L, midi_close);
+  lua_setfield(L, -2, "close");
+  lua_pushcfunction(L, midi_close);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+}
+
+LUALIB_API int luaopen_emstrument (lua_State *L) {
+  static pthread_once_t defaultContextOnce = PTHREAD_ONCE_INIT;
+  keepModuleLoaded();
+  pthread_once(&defaultContextOnce, defaultContextInit);
+  registerMethods(L);
+  luaL_register(L, "MIDI", kMidilib);
+  for (int i = 0; kEventKinds[i].name != NULL; i++) {
+    lua_pushinteger(L, kEventKinds[i].kind);
+    lua_setfield(L, -2, kEventKinds[i].name);
+  }
+  return 0;
+}
+
+
+/* -- C API -- */
+
+// Channel argument is in range 1-16 (17-32 for the second port etc.), subtract 1 for zero-indexed channel.
+// Argument of '0' will still go to zero-indexed channel 0.
+static inline int channelIndex(int channel)
+{
+    channel--;
+    if (channel >= defaultContext.channelCount) channel = defaultContext.channelCount - 1;
+    if (channel < 0) channel = 0; // (also before MIDI.init(), when there are no channels yet)
+    return channel;
+}
+
+static inline int emstQueue(command c)
+{
+    if (!initcheck(&defaultContext)) {
+        return EMST_NOT_INITIALIZED;
+    }
+    return tryQueueCommand(&defaultContext, c) ? EMST_OK : EMST_QUEUE_FULL;
+}
+
+// Same as MIDI.noteon(note, vel, ch)
+int emst_noteon(int ch, int note, int vel)
+{
+    // 0 velocity = no-op (might otherwise act as a note off)
+    if ((vel & 0x7F) == 0) {
+        return initcheck(&defaultContext) ? EMST_OK : EMST_NOT_INITIALIZED;
+    }
+    return emstQueue(makeCommand(kNoteOn, channelIndex(ch), note & 0x7F, vel & 0x7F, 0));
+}
+
+// Same as MIDI.noteoff(note, ch)
+int emst_noteoff(int ch, int note)
+{
+    return emstQueue(makeCommand(kNoteOff, channelIndex(ch), note & 0x7F, 0, 0));
+}
+
+// Same as MIDI.noteonwithduration(note, vel, duration, ch)
+int emst_noteonwithduration(int ch, int note, int vel, int duration)
+{
+    // do nothing for 0 velocity, or 0 or negative duration
+    if (((vel & 0x7F) == 0) || !(duration > 0)) {
+        return initcheck(&defaultContext) ? EMST_OK : EMST_NOT_INITIALIZED;
+    }
+    return emstQueue(makeCommand(kNoteOnWithDuration, channelIndex(ch), note & 0x7F, vel & 0x7F, duration));
+}
+
+// Same as MIDI.CC(cc, value, ch)
+int emst_cc(int ch, int cc, int value)
+{
+    // keep CC in 0-119 range
+    if (cc < 0) {
+        cc = 0;
+    }
+    if (cc > 119) {
+        cc = 119;
+    }
+    return emstQueue(makeCommand(kCC, channelIndex(ch), cc, value & 0x7F, 0));
+}
+
+// Same as MIDI.pitchbend(bend, ch)
+int emst_pitchbend(int ch, double bend)
+{
+    int pbvalue14b = pitchBendValue(bend);
+    return emstQueue(makeCommand(kPitchBend, channelIndex(ch), (pbvalue14b >> 7) & 0x7F, pbvalue14b & 0x7F, 0));
+}
+
+// Same as MIDI.allnotesoff(ch)
+int emst_allnotesoff(int ch)
+{
+    return emstQueue(makeCommand(kResetNotes, channelIndex(ch), 0, 0, 0));
+}
+
+// Same as MIDI.panic()
+int emst_panic(void)
+{
+    return emstQueue(makeCommand(kResetAllNotes, 0, 0, 0, 0));
+}
+
+// Same as MIDI.sendmessages(): returns the number of batches handed to the backend
+int emst_flush(void)
+{
+    if (!initcheck(&defaultContext)) {
+        return EMST_NOT_INITIALIZED;
+    }
+    return sendMessages(&defaultContext);
+}
+
+
+/* -- MIDI sending functions (only to be called from midi_sendMessages() and the note scheduler) -- */
+
+static bool portBufferAlloc(portBuffer *buffer, size_t size)
+{
+    uint8_t *bytes = realloc(buffer->bytes, size);
+    if (bytes == NULL) {
+        return false; // keep the old buffer, it just means more backend sends
+    }
+    buffer->bytes = bytes;
+    buffer->size = size;
+    return true;
+}
+
+// Makes the buffer of each of the context's ports at least size bytes
+static bool batchAlloc(messageBatch *batch, size_t size)
+{
+    bool ok = true;
+    for (int port = 0; port < batch->ctx->portCount; port++) {
+        if (batch->ports[port].size < size) {
+            ok = portBufferAlloc(&batch->ports[port], size) && ok;
+        }
+    }
+    return ok;
+}
+
+static void batchBegin(messageBatch *batch)
+{
+    for (int port = 0; port < batch->ctx->portCount; port++) {
+        batch->ports[port].length = 0;
+    }
+    batch->submissions = 0;
+    batch->messages = 0;
+}
+
+// Sends one port's messages added since the last submit (if any), and empties its buffer.
+static void batchSubmitPort(messageBatch *batch, int port)
+{
+    portBuffer *buffer = &batch->ports[port];
+    if (buffer->length > 0) {
+        batch->sink(batch->ctx, port, buffer->bytes, buffer->length);
+        batch->submissions++;
+    }
+    buffer->length = 0;
+}
+
+// Sends everything added since the last submit, one backend send per port, and empties the batch.
+static void batchSubmit(messageBatch *batch)
+{
+    for (int port = 0; port < batch->ctx->portCount; port++) {
+        batchSubmitPort(batch, port);
+    }
+}
+
+// ch is a context channel (port * 16 + MIDI channel), status a channel message without its channel
+static void batchAdd(messageBatch *batch, uint8_t status, int ch, uint8_t data1, uint8_t data2)
+{
+    int port = CHANNEL_PORT(ch);
+    portBuffer *buffer = &batch->ports[port];
+    if (buffer->length + 3 > buffer->size) {
+        // the port's buffer is full: grow it, or send it if that's not possible
+        if (!portBufferAlloc(buffer, (buffer->size > 0) ? buffer->size * 2 : BATCH_BLOCK)) {
+            batchSubmitPort(batch, port);
+        }
+    }
+    uint8_t *msg = &buffer->bytes[buffer->length];
+    msg[0] = status | CHANNEL_MIDI(ch);
+    msg[1] = data1;
+    msg[2] = data2;
+    buffer->length += 3;
+    batch->messages++;
+}
+
+static void sendNoteOn(messageBatch *batch, int ch, int note, int vel)
+{
+    emstContext *ctx = batch->ctx;
+    // Update the note's generation before sending out the MIDI message
+    noteStarted(ctx, ch, note);
+    // The note is being retriggered without a duration, so it shouldn't be turned off later
+    cancelNoteOff(ctx, ch, note);
+        
+    batchAdd(batch, 0x90, ch, note, vel);
+}
+
+// The note off is scheduled relative to the batch's base time, which for delayed note ons is
+// the base time of the frame they were played in, so the note-on delay doesn't make them longer
+static void sendNoteOnWithDuration(messageBatch *batch, int ch, int note, int vel, int duration)
+{
+    emstContext *ctx = batch->ctx;
+    // Update the note's generation before sending out the MIDI message
+    uint32_t currentNoteID = noteStarted(ctx, ch, note);
+        
+    batchAdd(batch, 0x90, ch, note, vel);
+    
+    // note off scheduling, the using a timestamp with MIDIReceived() doesn't seem to work all the time
+    // (replaces the note off scheduled for the last time this note was played, if there is one)
+    scheduleNoteOff(ctx, ch, note, currentNoteID, batch->baseTime + duration * ctx->durationUnitNs);
+}
+
+static void sendNoteOff(messageBatch *batch, int ch, int note)
+{
+    emstContext *ctx = batch->ctx;
+    batchAdd(batch, 0x80, ch, note, 100);
+    
+    noteStopped(ctx, ch, note);
+    cancelNoteOff(ctx, ch, note);
+}
+
+// Dropped if the receiver already has this value, see ccShadow
+static void sendCC(messageBatch *batch, int ch, int CC, int value)
+{
+    emstContext *ctx = batch->ctx;
+    if (!batch->controllerRefresh && ctx->ccShadow[ch][CC] == value) {
+        return;
+    }
+    ctx->ccShadow[ch][CC] = value;
+    batchAdd(batch, 0xB0, ch, CC, value);
+}
+
+static void sendPitchBend(messageBatch *batch, int ch, int msb, int lsb)
+{
+    emstContext *ctx = batch->ctx;
+    int value = (msb << 7) | lsb;
+    if (!batch->controllerRefresh && ctx->pitchBendShadow[ch] == value) {
+        return;
+    }
+    ctx->pitchBendShadow[ch] = value;
+    batchAdd(batch, 0xE0, ch, lsb, msb);
+}
+
+// Sends every controller value in the shadow (used by MIDI.resync())
+static void sendControllerShadow(messageBatch *batch)
+{
+    emstContext *ctx = batch->ctx;
+    for (int ch = 0; ch < ctx->channelCount; ch++) {
+        for (int CC = 0; CC < 128; CC++) {
+            if (ctx->ccShadow[ch][CC] >= 0) {
+                batchAdd(batch, 0xB0, ch, CC, ctx->ccShadow[ch][CC]);
+            }
+        }
+        if (ctx->pitchBendShadow[ch] >= 0) {
+            batchAdd(batch, 0xE0, ch, ctx->pitchBendShadow[ch] & 0x7F, ctx->pitchBendShadow[ch] >> 7);
+        }
+    }
+}
+
+static void sendResetNotes(messageBatch *batch, int ch)
+{
+    emstContext *ctx = batch->ctx;
+    // quantized notes that haven't started yet would otherwise start after the reset
+    cancelQuantizedNotes(ctx, ch);
+    
+    // only turn off notes currently playing, to avoid message congestion
+    for (int half = 0; half < 2; half++) {
+        // take the whole set at once, notes started by another thread from now on keep playing
+        uint64_t bits = atomic_exchange(&ctx->playingNoteBits[ch][half], 0);
+        while (bits) {
+            int note = (half << 6) | __builtin_ctzll(bits);
+            bits &= bits - 1;
+            // (if a scheduled note off gets to the note first, only one of them sends a note off)
+            if (atomic_fetch_and(&ctx->noteStates[ch][note], ~NOTE_PLAYING) & NOTE_PLAYING) {
+                batchAdd(batch, 0x80, ch, note, 0);
+                cancelNoteOff(ctx, ch, note);
+            }
+            restorePlayingBit(ctx, ch, note);
+        }
+    }
+}
+
+// Turns off every note on every channel, and drops every quantized note that hasn't started yet
+static void sendResetAllNotes(messageBatch *batch)
+{
+    emstContext *ctx = batch->ctx;
+    cancelQuantizedNotes(ctx, -1);
+    for (int ch = 0; ch < ctx->channelCount; ch++) {
+        if (atomic_load_explicit(&ctx->playingNoteBits[ch][0], memory_order_relaxed) |
+            atomic_load_explicit(&ctx->playingNoteBits[ch][1], memory_order_relaxed)) {
+            sendResetNotes(batch, ch);
+        }
+    }
+}
+
+static void sendCommand(messageBatch *batch, command c)
+{
+    switch (cmdType(c)) {
+        case kNoteOn:
+            sendNoteOn(batch, cmdChannel(c), cmdData1(c), cmdData2(c));
+            break;
+        case kNoteOnWithDuration:
+            sendNoteOnWithDuration(batch, cmdChannel(c), cmdData1(c), cmdData2(c), cmdDuration(c));
+            break;
+        case kNoteOff:
+            sendNoteOff(batch, cmdChannel(c), cmdData1(c));
+            break;
+        case kCC:
+            sendCC(batch, cmdChannel(c), cmdData1(c), cmdData2(c));
+            break;
+        case kPitchBend:
+            sendPitchBend(batch, cmdChannel(c), cmdData1(c), cmdData2(c));
+            break;
+        case kResetNotes:
+            sendResetNotes(batch, cmdChannel(c));
+            break;
+        case kResetAllNotes:
+            sendResetAllNotes(batch);
+            break;
+        default: // covers -1/invalid
+            break;
+    }
+}
+
+// Sends a frame: the commands left after removing the redundant ones (see sendMessages()), and
+// with resync, every known controller value first. Note ons for notes that are already playing are
+// turned into note offs, and sent again after the rest of the frame, in a batch of their own, or
+// by the note scheduler if there's a note-on delay. This may be necessary because if a note off is
+// sent at the same time as a note on, it ends up having the same timestamp as the note on event,
+// and they might cancel each other out, as the order of events with the same timestamp apparently
+// can vary.
+// Called on the Lua thread by sendMessages(), or on the scheduler thread at the frame's target time
+// in lookahead mode, so that the note states it looks at are the ones at the time the frame goes
+// out. delayed needs room for count commands. Returns the number of backend sends, and sets sent
+// to the number of messages and delayedCount to the number of delayed note ons.
+static int sendFrame(messageBatch *batch, command *commands, int count, command *delayed, bool resync,
+                     int *sent, int *delayedCount)
+{
+    emstContext *ctx = batch->ctx;
+    int delayedIndex = 0;
+    for (int i = 0; i < count; i++) {
+        int type = cmdType(commands[i]);
+        if (((type == kNoteOn) || (type == kNoteOnWithDuration)) &&
+            isNotePlaying(ctx, cmdChannel(commands[i]), cmdData1(commands[i]))) {
+            delayed[delayedIndex] = commands[i];
+            delayedIndex++;
+            // We need to turn off the note since it's already playing
+            commands[i] = cmdWithType(commands[i], kNoteOff);
+        }
+    }
+    
+    // Batches grow when they're full, but flushBatch is always big enough for every command in the
+    // queue, so it only needs to grow if reset notes commands turn off a lot of notes.
+    batchBegin(batch);
+    if (resync) {
+        sendControllerShadow(batch);
+    }
+    for (int i = 0; i < count; i++) {
+        sendCommand(batch, commands[i]);
+    }
+    batchSubmit(batch);
+    int submissions = batch->submissions;
+    *sent = batch->messages;
+    
+    // Without a note-on delay the delayed note ons are sent right away in a batch of their own,
+    // otherwise they're handed to the note scheduler.
+    if (delayedIndex > 0) {
+        if (ctx->lateNoteOffsetNs > 0) {
+            for (int i = 0; i < delayedIndex; i++) {
+                scheduleNoteOn(ctx, delayed[i], batch->baseTime, batch->baseTime + ctx->lateNoteOffsetNs);
+            }
+        } else {
+            batchBegin(batch);
+            for (int i = 0; i < delayedIndex; i++) {
+                sendCommand(batch, delayed[i]);
+            }
+            batchSubmit(batch);
+            submissions += batch->submissions;
+            *sent += batch->messages;
+        }
+    }
+    *delayedCount = delayedIndex;
+    return submissions;
+}
+
+
+/* -- Note scheduler -- */
+// Timed events are kept in a hashed timing wheel driven by a single timer thread, instead of one
+// timer per note. Only the latest note off (and delayed note on) for a note matters, so each
+// (channel, note) has one preallocated entry for each, which makes scheduling, rescheduling and
+// cancelling O(1) without allocating anything. Entries are hashed into a slot by deadline, and
+// entries further away than the wheel's span wait in their slot for more turns.
+// Everything expiring on the same tick is sent in one batch.
+// Each context has its own wheel and scheduler thread (see emstContext).
+
+#define TIMED_RING_SIZE (1 << 20) // room for the batches published in lookahead mode
+
+// Beat grid: grid tick n starts at gridOriginNs + (n - gridOriginTick) * gridTickNs. Quantized
+// note ons are kept in a bucket per grid tick (hashed like the timing wheel, entries for later
+// turns wait in their bucket), and every scheduler tick releases the buckets of the grid ticks
+// that have started since the last one. Everything is protected by schedulerLock.
+
+static bool schedulerIdleLocked(emstContext *ctx)
+{
+    return (ctx->scheduledCount == 0) && (ctx->timedBatchCount == 0) && (ctx->quantizedCount == 0);
+}
+
+// Clock: monotonic time in ns, and waiting for schedulerWake until an absolute time on the same
+// clock, so that the scheduler thread's wake ups don't drift by the time it spends ticking. This
+// is mach_absolute_time() on OS X (which can only wait for a relative time), and CLOCK_MONOTONIC
+// elsewhere (CLOCK_MONOTONIC_RAW would avoid NTP slewing, but condition variables can't use it).
+#ifdef __APPLE__
+static mach_timebase_info_data_t timebase;
+
+static void clockInit(void)
+{
+    if (timebase.denom == 0) {
+        mach_timebase_info(&timebase);
+    }
+}
+#endif
+
+static uint64_t currentTimeNs(void)
+{
+#ifdef __APPLE__
+    clockInit();
+    return mach_absolute_time() * timebase.numer / timebase.denom;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+// Waits for schedulerWake until time at most
+static void waitForSchedulerWakeLocked(emstContext *ctx, uint64_t time)
+{
+#ifdef __APPLE__
+    uint64_t now = currentTimeNs();
+    if (time <= now) {
+        return;
+    }
+    struct timespec wait = {(time - now) / 1000000000, (time - now) % 1000000000};
+    pthread_cond_timedwait_relative_np(&ctx->schedulerWake, &ctx->schedulerLock, &wait);
+#else
+    struct timespec deadline = {time / 1000000000, time % 1000000000};
+    pthread_cond_timedwait(&ctx->schedulerWake, &ctx->schedulerLock, &deadline);
+#endif
+}
+
+// The scheduler normally runs on the monotonic clock. Once MIDI.advanceclock() has been called,
+// it runs on a manual clock instead, which only moves (and sends timed events) when
+// MIDI.advanceclock() is called, so test harnesses can replay scripts faster than real time
+// and get the same output every time. Both are only changed under schedulerLock, and are atomic
+// so that schedulerClockNs() can read them without it.
+
+// Time used by the scheduler, in ns
+static uint64_t schedulerTimeNs(emstContext *ctx)
+{
+    return ctx->manualClock ? ctx->manualClockNs : currentTimeNs();
+}
+
+static uint64_t currentTick(emstContext *ctx)
+{
+    return schedulerTimeNs(ctx) / WHEEL_TICK_NS;
+}
+
+// Time used by the scheduler, for use outside of schedulerLock
+static uint64_t schedulerNowNs(emstContext *ctx)
+{
+    pthread_mutex_lock(&ctx->schedulerLock);
+    uint64_t now = schedulerTimeNs(ctx);
+    pthread_mutex_unlock(&ctx->schedulerLock);
+    return now;
+}
+
+// Time used by the scheduler, without taking schedulerLock, for the send paths of backends that
+// mustn't wait for a scheduler tick. manualClockNs is set before manualClock when the manual
+// clock is switched on, so it's never read before it's valid.
+static uint64_t schedulerClockNs(emstContext *ctx)
+{
+    if (atomic_load_explicit(&ctx->manualClock, memory_order_acquire)) {
+        return atomic_load_explicit(&ctx->manualClockNs, memory_order_relaxed);
+    }
+    return currentTimeNs();
+}
+
+static void schedulerTick(emstContext *ctx);
+
+// Wakes the scheduler thread if time (in ns) is earlier than what it's sleeping until. Times are
+// rounded up to the start of a wheel tick, which is when the scheduler thread always ticks.
+static void lowerSchedulerDeadlineLocked(emstContext *ctx, uint64_t time)
+{
+    uint64_t deadline = (time + WHEEL_TICK_NS - 1) / WHEEL_TICK_NS * WHEEL_TICK_NS;
+    if (deadline < ctx->schedulerDeadlineNs) {
+        ctx->schedulerDeadlineNs = deadline;
+        pthread_cond_signal(&ctx->schedulerWake);
+    }
+}
+
+// Sleeps until schedulerDeadlineNs and ticks the wheel then, or until something is scheduled
+// if nothing is, until schedulerStop() is called. Scheduling something earlier than the
+// deadline wakes it up to sleep until the new one instead (see lowerSchedulerDeadlineLocked()).
+static void *schedulerThreadMain(void *arg)
+{
+    emstContext *ctx = arg;
+    pthread_mutex_lock(&ctx->schedulerLock);
+    while (!ctx->schedulerStopping) {
+        if (schedulerIdleLocked(ctx) || ctx->manualClock) {
+            ctx->schedulerDeadlineNs = UINT64_MAX; // so the next thing scheduled wakes it up
+            pthread_cond_wait(&ctx->schedulerWake, &ctx->schedulerLock);
+            continue;
+        }
+        if (currentTimeNs() < ctx->schedulerDeadlineNs) {
+            waitForSchedulerWakeLocked(ctx, ctx->schedulerDeadlineNs);
+            continue;
+        }
+        pthread_mutex_unlock(&ctx->schedulerLock);
+        
+        schedulerTick(ctx);
+        
+        pthread_mutex_lock(&ctx->schedulerLock);
+    }
+    pthread_mutex_unlock(&ctx->schedulerLock);
+    return NULL;
+}
+
+static bool schedulerInit(emstContext *ctx)
+{
+    if (!batchAlloc(&ctx->schedulerBatch, BATCH_BLOCK) || !ringInit(&ctx->timedRing, TIMED_RING_SIZE)) {
+        return false;
+    }
+    ctx->wheelTick = currentTick(ctx);
+    ctx->schedulerDeadlineNs = UINT64_MAX;
+    if (pthread_create(&ctx->schedulerThread, NULL, schedulerThreadMain, ctx) != 0) {
+        return false;
+    }
+    ctx->schedulerStarted = true;
+    return true;
+}
+
+// Stops the scheduler thread. Anything still scheduled is dropped.
+static void schedulerStop(emstContext *ctx)
+{
+    if (!ctx->schedulerStarted) {
+        return;
+    }
+    pthread_mutex_lock(&ctx->schedulerLock);
+    ctx->schedulerStopping = true;
+    pthread_cond_signal(&ctx->schedulerWake);
+    pthread_mutex_unlock(&ctx->schedulerLock);
+    pthread_join(ctx->schedulerThread, NULL);
+    ctx->schedulerStarted = false;
+}
+
+static void unscheduleLocked(emstContext *ctx, scheduledEvent *e)
+{
+    if (!e->pending) {
+        return;
+    }
+    if (e->prev) {
+        e->prev->next = e->next;
+    } else {
+        ctx->timingWheel[e->deadline & (WHEEL_SLOTS - 1)] = e->next;
+    }
+    if (e->next) {
+        e->next->prev = e->prev;
+    }
+    e->pending = false;
+    ctx->scheduledCount--;
+    if (cmdType(e->cmd) == kNoteOff) {
+        ctx->noteOffsScheduled--;
+    }
+}
+
+static void scheduleLocked(emstContext *ctx, scheduledEvent *e, uint64_t time)
+{
+    unscheduleLocked(ctx, e);
+    
+    // the first tick at or after the exact time, the same rule lookahead frames follow, so
+    // that note lengths don't depend on where in a tick the note started
+    uint64_t deadline = (time + WHEEL_TICK_NS - 1) / WHEEL_TICK_NS;
+    if (deadline <= ctx->wheelTick) {
+        deadline = ctx->wheelTick + 1; // already due, go out on the next tick
+    }
+    e->deadline = deadline;
+    e->time = time;
+    
+    scheduledEvent **slot = &ctx->timingWheel[deadline & (WHEEL_SLOTS - 1)];
+    e->prev = NULL;
+    e->next = *slot;
+    if (*slot) {
+        (*slot)->prev = e;
+    }
+    *slot = e;
+    e->pending = true;
+    ctx->scheduledCount++;
+    if (cmdType(e->cmd) == kNoteOff) {
+        ctx->noteOffsScheduled++;
+    }
+    
+    lowerSchedulerDeadlineLocked(ctx, deadline * WHEEL_TICK_NS);
+}
+
+static void scheduleNoteOff(emstContext *ctx, int ch, int note, uint32_t noteID, uint64_t time)
+{
+    pthread_mutex_lock(&ctx->schedulerLock);
+    scheduledEvent *e = &ctx->scheduledNoteOffs[ch][note];
+    e->cmd = makeCommand(kNoteOff, ch, note, 0, 0);
+    e->noteID = noteID;
+    scheduleLocked(ctx, e, time);
+    pthread_mutex_unlock(&ctx->schedulerLock);
+}
+
+// baseTime: the base time of the frame the note was played in, its duration starts from there
+static void scheduleNoteOn(emstContext *ctx, command c, uint64_t baseTime, uint64_t time)
+{
+    pthread_mutex_lock(&ctx->schedulerLock);
+    scheduledEvent *e = &ctx->scheduledNoteOns[cmdChannel(c)][cmdData1(c)];
+    e->cmd = c;
+    e->baseTime = baseTime;
+    scheduleLocked(ctx, e, time);
+    pthread_mutex_unlock(&ctx->schedulerLock);
+}
+
+static void cancelNoteOff(emstContext *ctx, int ch, int note)
+{
+    pthread_mutex_lock(&ctx->schedulerLock);
+    unscheduleLocked(ctx, &ctx->scheduledNoteOffs[ch][note]);
+    pthread_mutex_unlock(&ctx->schedulerLock);
+}
+
+static int scheduledNoteOffCount(emstContext *ctx)
+{
+    pthread_mutex_lock(&ctx->schedulerLock);
+    int count = ctx->noteOffsScheduled;
+    pthread_mutex_unlock(&ctx->schedulerLock);
+    return count;
+}
+
+// Number of grid ticks that have started at time ns
+static uint64_t gridTicksStartedLocked(emstContext *ctx, uint64_t ns)
+{
+    if (ns < ctx->gridOriginNs) {
+        return ctx->gridOriginTick;
+    }
+    return ctx->gridOriginTick + (uint64_t)((ns - ctx->gridOriginNs) / ctx->gridTickNs) + 1;
+}
+
+// Time grid tick n starts at, in ns
+static uint64_t gridTickTimeLocked(emstContext *ctx, uint64_t tick)
+{
+    return (uint64_t)((double)ctx->gridOriginNs + ((double)tick - (double)ctx->gridOriginTick) * ctx->gridTickNs);
+}
+
+static void setTempoLocked(emstContext *ctx, double bpm, int ppq)
+{
+    uint64_t now = schedulerTimeNs(ctx);
+    if (ctx->gridStarted) {
+        // the new tempo starts on the next grid tick, so notes keep their place in the bar
+        uint64_t nextTick = gridTicksStartedLocked(ctx, now);
+        ctx->gridOriginNs += (uint64_t)((nextTick - ctx->gridOriginTick) * ctx->gridTickNs);
+        ctx->gridOriginTick = nextTick;
+    } else {
+        ctx->gridOriginNs = now;
+        ctx->gridOriginTick = 0;
+        ctx->gridNextTick = 0;
+        ctx->gridStarted = true;
+    }
+    ctx->gridTickNs = 60e9 / (bpm * ppq);
+    if (ctx->quantizedCount > 0) {
+        lowerSchedulerDeadlineLocked(ctx, 0); // the notes waiting for the grid have moved
+    }
+}
+
+static void setTempo(emstContext *ctx, double bpm, int ppq)
+{
+    pthread_mutex_lock(&ctx->schedulerLock);
+    setTempoLocked(ctx, bpm, ppq);
+    pthread_mutex_unlock(&ctx->schedulerLock);
+}
+
+// Holds a note on command until the next grid tick that's a multiple of grid. Returns false if
+// there was no memory for it.
+static bool quantizeNoteOn(emstContext *ctx, command c, int grid)
+{
+    pthread_mutex_lock(&ctx->schedulerLock);
+    if (!ctx->gridStarted) {
+        setTempoLocked(ctx, DEFAULT_TEMPO, DEFAULT_PPQ);
+    }
+    
+    // first grid boundary at or after now, which hasn't been released yet
+    uint64_t now = schedulerTimeNs(ctx);
+    uint64_t tick = ctx->gridOriginTick;
+    if (now > ctx->gridOriginNs) {
+        tick += (uint64_t)ceil((now - ctx->gridOriginNs) / ctx->gridTickNs);
+    }
+    if (tick < ctx->gridNextTick) {
+        tick = ctx->gridNextTick;
+    }
+    tick = (tick + grid - 1) / grid * grid;
+    
+    gridBucket *bucket = &ctx->gridBuckets[tick & (GRID_BUCKETS - 1)];
+    for (int i = 0; i < bucket->count; i++) {
+        quantizedNote *n = &bucket->notes[i];
+        if ((n->tick == tick) && (cmdChannel(n->cmd) == cmdChannel(c)) && (cmdData1(n->cmd) == cmdData1(c))) {
+            n->cmd = c; // the same note is already waiting for this tick, the last one wins
+            pthread_mutex_unlock(&ctx->schedulerLock);
+            return true;
+        }
+    }
+    if (bucket->count == bucket->size) {
+        int size = (bucket->size > 0) ? bucket->size * 2 : 8;
+        quantizedNote *notes = realloc(bucket->notes, size * sizeof(quantizedNote));
+        if (notes == NULL) {
+            pthread_mutex_unlock(&ctx->schedulerLock);
+            return false;
+        }
+        bucket->notes = notes;
+        bucket->size = size;
+    }
+    bucket->notes[bucket->count].tick = tick;
+    bucket->notes[bucket->count].cmd = c;
+    bucket->count++;
+    
+    ctx->quantizedCount++;
+    lowerSchedulerDeadlineLocked(ctx, gridTickTimeLocked(ctx, tick));
+    pthread_mutex_unlock(&ctx->schedulerLock);
+    return true;
+}
+
+// Drops the quantized notes waiting for the grid on channel ch (every channel for -1)
+static void cancelQuantizedNotes(emstContext *ctx, int ch)
+{
+    pthread_mutex_lock(&ctx->schedulerLock);
+    for (int b = 0; (b < GRID_BUCKETS) && (ctx->quantizedCount > 0); b++) {
+        gridBucket *bucket = &ctx->gridBuckets[b];
+        for (int i = 0; i < bucket->count; ) {
+            if ((ch < 0) || (cmdChannel(bucket->notes[i].cmd) == ch)) {
+                bucket->notes[i] = bucket->notes[--bucket->count];
+                ctx->quantizedCount--;
+            } else {
+                i++;
+            }
+        }
+    }
+    pthread_mutex_unlock(&ctx->schedulerLock);
+}
+
+// Moves the quantized notes of every grid tick started by nowNs to releasedNotes, in the order
+// of their ticks. Returns how many there are.
+static int releaseGridLocked(emstContext *ctx, uint64_t nowNs)
+{
+    if (ctx->quantizedCount == 0) {
+        if (ctx->gridStarted) {
+            ctx->gridNextTick = gridTicksStartedLocked(ctx, nowNs);
+        }
+        return 0;
+    }
+    if (ctx->releasedNotesSize < ctx->quantizedCount) {
+        quantizedNote *notes = realloc(ctx->releasedNotes, ctx->quantizedCount * sizeof(quantizedNote));
+        if (notes == NULL) {
+            return 0; // try again next tick
+        }
+        ctx->releasedNotes = notes;
+        ctx->releasedNotesSize = ctx->quantizedCount;
+    }
+    
+    int releasedCount = 0;
+    uint64_t endTick = gridTicksStartedLocked(ctx, nowNs);
+    // no need to look at the same bucket twice if the scheduler was late by more than a full turn
+    uint64_t lastTick = (endTick - ctx->gridNextTick > GRID_BUCKETS) ? ctx->gridNextTick + GRID_BUCKETS : endTick;
+    for (uint64_t tick = ctx->gridNextTick; tick < lastTick; tick++) {
+        gridBucket *bucket = &ctx->gridBuckets[tick & (GRID_BUCKETS - 1)];
+        for (int i = 0; i < bucket->count; ) {
+            if (bucket->notes[i].tick < endTick) {
+                ctx->releasedNotes[releasedCount] = bucket->notes[i];
+                ctx->releasedNotes[releasedCount].time = gridTickTimeLocked(ctx, bucket->notes[i].tick);
+                releasedCount++;
+                bucket->notes[i] = bucket->notes[--bucket->count];
+                ctx->quantizedCount--;
+            } else {
+                i++;
+            }
+        }
+    }
+    ctx->gridNextTick = endTick;
+    return releasedCount;
+}
+
+// Sends the timed batches that are due at nowNs
+static void sendTimedBatches(emstContext *ctx, uint64_t nowNs)
+{
+    size_t length;
+    while ((length = ringPeek(&ctx->timedRing)) > 0) {
+        uint64_t target;
+        ringPeekData(&ctx->timedRing, &target, sizeof(target));
+        if (target > nowNs) {
+            break;
+        }
+        int count = (int)((length - sizeof(timedBatchHeader)) / sizeof(command));
+        if (length > ctx->timedRecordSize) {
+            uint8_t *newRecord = realloc(ctx->timedRecord, length);
+            if (newRecord == NULL) {
+                break; // try again next tick
+            }
+            ctx->timedRecord = newRecord;
+            command *newDelayed = realloc(ctx->timedDelayedCommands, length); // (at least count commands)
+            if (newDelayed == NULL) {
+                break;
+            }
+            ctx->timedDelayedCommands = newDelayed;
+            ctx->timedRecordSize = length;
+        }
+        ringPop(&ctx->timedRing, ctx->timedRecord);
+        timedBatchHeader header;
+        memcpy(&header, ctx->timedRecord, sizeof(header));
+        
+        // the frame's timed events are scheduled relative to its target time, like they would be
+        // relative to the time of the flush without lookahead
+        int sent, delayed;
+        ctx->schedulerBatch.baseTime = header.target;
+        ctx->schedulerBatch.controllerRefresh = header.controllerRefresh;
+        sendFrame(&ctx->schedulerBatch, (command *)(ctx->timedRecord + sizeof(header)), count,
+                  ctx->timedDelayedCommands, header.resync, &sent, &delayed);
+        ctx->schedulerBatch.controllerRefresh = false;
+        atomic_fetch_add(&ctx->timedBatchesSent, 1);
+        
+        pthread_mutex_lock(&ctx->schedulerLock);
+        ctx->timedBatchCount--;
+        pthread_mutex_unlock(&ctx->schedulerLock);
+    }
+}
+
+// Works out when the scheduler next has something to do: the earliest timing wheel event, the
+// oldest timed batch or the earliest grid tick with notes waiting for it, whichever comes first,
+// looking at most a turn of the wheel and of the grid buckets ahead. Only called from
+// schedulerTick(), which is the only consumer of timedRing.
+static uint64_t schedulerDeadlineLocked(emstContext *ctx)
+{
+    if (schedulerIdleLocked(ctx)) {
+        return UINT64_MAX;
+    }
+    
+    uint64_t deadline = (ctx->wheelTick + WHEEL_SLOTS) * WHEEL_TICK_NS;
+    if (ctx->scheduledCount > 0) {
+        bool found = false;
+        for (uint64_t tick = ctx->wheelTick + 1; (tick < ctx->wheelTick + WHEEL_SLOTS) && !found; tick++) {
+            for (scheduledEvent *e = ctx->timingWheel[tick & (WHEEL_SLOTS - 1)]; e != NULL; e = e->next) {
+                if (e->deadline == tick) {
+                    deadline = tick * WHEEL_TICK_NS;
+                    found = true;
+                    break;
+                }
+            }
+        }
+    }
+    if ((ctx->timedBatchCount > 0) && (ringPeek(&ctx->timedRing) > 0)) {
+        uint64_t target;
+        ringPeekData(&ctx->timedRing, &target, sizeof(target));
+        if (target < deadline) {
+            deadline = target;
+        }
+    }
+    if (ctx->quantizedCount > 0) {
+        uint64_t lastTick = ctx->gridNextTick + GRID_BUCKETS;
+        for (uint64_t tick = ctx->gridNextTick; tick < lastTick; tick++) {
+            gridBucket *bucket = &ctx->gridBuckets[tick & (GRID_BUCKETS - 1)];
+            for (int i = 0; i < bucket->count; i++) {
+                if (bucket->notes[i].tick == tick) {
+                    lastTick = tick;
+                    break;
+                }
+            }
+        }
+        uint64_t gridTime = gridTickTimeLocked(ctx, lastTick);
+        if (gridTime < deadline) {
+            deadline = gridTime;
+        }
+    }
+    
+    // round up to the start of a wheel tick, and never the tick just processed, so that a time
+    // that turns out not to have been reached yet can't make the scheduler spin
+    uint64_t tick = (deadline + WHEEL_TICK_NS - 1) / WHEEL_TICK_NS;
+    if (tick <= ctx->wheelTick) {
+        tick = ctx->wheelTick + 1;
+    }
+    return tick * WHEEL_TICK_NS;
+}
+
+// Runs on the scheduler thread whenever anything is due
+static void schedulerTick(emstContext *ctx)
+{
+    pthread_mutex_lock(&ctx->schedulerTickLock);
+    int expiredCount = 0;
+    
+    // Collect expired events, then send them after releasing the lock (sending note ons
+    // schedules their note offs)
+    pthread_mutex_lock(&ctx->schedulerLock);
+    uint64_t nowNs = schedulerTimeNs(ctx);
+    bool timedBatchesWaiting = (ctx->timedBatchCount > 0);
+    uint64_t now = nowNs / WHEEL_TICK_NS;
+    // no need to look at the same slot twice if the timer was late by more than a full turn
+    uint64_t lastTick = (now - ctx->wheelTick > WHEEL_SLOTS) ? ctx->wheelTick + WHEEL_SLOTS : now;
+    for (uint64_t tick = ctx->wheelTick + 1; tick <= lastTick; tick++) {
+        scheduledEvent *e = ctx->timingWheel[tick & (WHEEL_SLOTS - 1)];
+        while (e != NULL) {
+            scheduledEvent *next = e->next;
+            if (e->deadline <= now) {
+                unscheduleLocked(ctx, e);
+                ctx->expiredEvents[expiredCount] = *e;
+                expiredCount++;
+            }
+            e = next;
+        }
+    }
+    if (now > ctx->wheelTick) {
+        ctx->wheelTick = now;
+    }
+    int releasedCount = releaseGridLocked(ctx, nowNs);
+    pthread_mutex_unlock(&ctx->schedulerLock);
+    
+    // frames go out before the note offs due at the same time, like in midi_sendMessages()
+    if (timedBatchesWaiting) {
+        sendTimedBatches(ctx, nowNs);
+    }
+    
+    if ((expiredCount == 0) && (releasedCount == 0)) {
+        pthread_mutex_lock(&ctx->schedulerLock);
+        ctx->schedulerDeadlineNs = schedulerDeadlineLocked(ctx);
+        pthread_mutex_unlock(&ctx->schedulerLock);
+        pthread_mutex_unlock(&ctx->schedulerTickLock);
+        return;
+    }
+    
+    batchBegin(&ctx->schedulerBatch);
+    for (int i = 0; i < expiredCount; i++) {
+        command c = ctx->expiredEvents[i].cmd;
+        if (cmdType(c) == kNoteOff) {
+            // If the same note has been played since this one, don't send
+            // note off message (it's already been turned off)
+            if (noteExpired(ctx, cmdChannel(c), cmdData1(c), ctx->expiredEvents[i].noteID)) {
+                batchAdd(&ctx->schedulerBatch, 0x80, cmdChannel(c), cmdData1(c), 0);
+                ctx->expiredEvents[i].pending = true; // (reused to mark note offs that were sent)
+            }
+        } else {
+            // delayed note on
+            ctx->schedulerBatch.baseTime = ctx->expiredEvents[i].baseTime;
+            sendCommand(&ctx->schedulerBatch, c);
+        }
+    }
+    // quantized notes go after the note offs, so a note that ends on a beat can start again on it
+    for (int i = 0; i < releasedCount; i++) {
+        command c = ctx->releasedNotes[i].cmd;
+        if (isNotePlaying(ctx, cmdChannel(c), cmdData1(c))) {
+            sendNoteOff(&ctx->schedulerBatch, cmdChannel(c), cmdData1(c));
+        }
+        ctx->schedulerBatch.baseTime = ctx->releasedNotes[i].time;
+        sendCommand(&ctx->schedulerBatch, c);
+    }
+    batchSubmit(&ctx->schedulerBatch);
+    
+    // how late were the note offs?
+    pthread_mutex_lock(&ctx->schedulerLock);
+    uint64_t sentTime = schedulerTimeNs(ctx);
+    ctx->schedulerDeadlineNs = schedulerDeadlineLocked(ctx);
+    pthread_mutex_unlock(&ctx->schedulerLock);
+    for (int i = 0; i < expiredCount; i++) {
+        if ((cmdType(ctx->expiredEvents[i].cmd) == kNoteOff) && ctx->expiredEvents[i].pending) {
+            uint64_t deadline = ctx->expiredEvents[i].time;
+            histogramRecord(&ctx->noteOffLatency, (sentTime > deadline) ? (sentTime - deadline) / 1000 : 0);
+        }
+    }
+    pthread_mutex_unlock(&ctx->schedulerTickLock);
+}
+
+// Lookahead mode's frame clock: it advances by the average frame length every frame, and is
+// nudged towards the time MIDI.sendmessages() is actually called, so it follows the emulator's
+// frame rate without its jitter. It starts again from the current time whenever a frame is
+// more than half a frame early or late (pauses, fast-forward, lag), or the first time.
+#define FRAME_CLOCK_PHASE_GAIN 8 // moves 1/8th of the way to the actual time every frame
+#define FRAME_CLOCK_PERIOD_GAIN 64 // adjusts the frame length by 1/64th of the error every frame
+
+// Moves the frame clock to the frame being sent, and returns the time to send it at, in ns.
+// Only called on the Lua thread.
+static uint64_t lookaheadTarget(emstContext *ctx)
+{
+    uint64_t now = schedulerNowNs(ctx);
+    
+    double error = (double)now - ((double)ctx->frameClockNs + ctx->frameClockPeriodNs);
+    if ((ctx->frameClockNs == 0) || (fabs(error) > ctx->frameClockPeriodNs / 2)) {
+        ctx->frameClockNs = now;
+    } else {
+        ctx->frameClockNs += (uint64_t)(ctx->frameClockPeriodNs + error / FRAME_CLOCK_PHASE_GAIN);
+        ctx->frameClockPeriodNs += error / FRAME_CLOCK_PERIOD_GAIN;
+    }
+    
+    uint64_t target = ctx->frameClockNs + (uint64_t)(ctx->lookahead * 1000000);
+    if (target < now) {
+        target = now;
+    }
+    if (target < ctx->lastTargetNs) {
+        target = ctx->lastTargetNs; // frames never overtake each other
+    }
+    ctx->lastTargetNs = target;
+    return target;
+}
+
+// Hands a frame's commands (what's left of the queue after removing the redundant ones) to the
+// scheduler, stamped with the frame's target time, which sends them with sendFrame() when it
+// comes. Frames too big for one batch are split. Returns the number of batches published.
+static int lookaheadPublish(emstContext *ctx, uint64_t target, const command *commands, int count,
+                            bool controllerRefresh, bool resync)
+{
+    if ((count == 0) && !resync) {
+        return 0;
+    }
+    
+    int batches = 0;
+    do {
+        int batchCount = (count > TIMED_BATCH_MAX) ? TIMED_BATCH_MAX : count;
+        timedBatchHeader header = {target, controllerRefresh, resync};
+        // The ring only fills up if the backend has stalled for a very long time, or on the manual
+        // clock if it hasn't been moved forward for a long time, in which case the Lua thread has
+        // to wait, since dropping messages could leave notes stuck.
+        while (!ringFits(&ctx->timedRing, sizeof(header) + batchCount * sizeof(command))) {
+            if (ctx->manualClock) {
+                advanceSchedulerClock(ctx, 1); // nothing else is going to send them
+            } else {
+                struct timespec nap = {0, 1000000};
+                nanosleep(&nap, NULL);
+            }
+        }
+        ringPushWithHeader(&ctx->timedRing, &header, sizeof(header), (const uint8_t *)commands,
+                           batchCount * sizeof(command));
+        commands += batchCount;
+        count -= batchCount;
+        resync = false;
+        batches++;
+        ctx->timedBatchesPublished++;
+        
+        pthread_mutex_lock(&ctx->schedulerLock);
+        ctx->timedBatchCount++;
+        lowerSchedulerDeadlineLocked(ctx, target);
+        pthread_mutex_unlock(&ctx->schedulerLock);
+    } while (count > 0);
+    return batches;
+}
+
+// Waits until every batch published has been sent, not just taken out of the ring, so that
+// nothing sent from the Lua thread afterwards can overtake it
+static void lookaheadWaitUntilSent(emstContext *ctx)
+{
+    while (atomic_load(&ctx->timedBatchesSent) != ctx->timedBatchesPublished) {
+        if (ctx->manualClock) {
+            advanceSchedulerClock(ctx, 1); // nothing else is going to send them
+        } else {
+            struct timespec nap = {0, 1000000};
+            nanosleep(&nap, NULL);
+        }
+    }
+}
+
+// Switches the scheduler to the manual clock (starting from the current time) if it isn't
+// already using it, and moves it forward by ms, sending everything that becomes due one tick
+// at a time, on the calling thread.
+static void advanceSchedulerClock(emstContext *ctx, double ms)
+{
+    pthread_mutex_lock(&ctx->schedulerLock);
+    if (!ctx->manualClock) {
+        // start on a tick boundary, so tick numbers don't depend on when the switch happened
+        ctx->manualClockNs = currentTick(ctx) * WHEEL_TICK_NS;
+        ctx->manualClock = true;
+    }
+    pthread_mutex_unlock(&ctx->schedulerLock);
+    
+    uint64_t remaining = (uint64_t)(ms * 1000000);
+    while (remaining > 0) {
+        uint64_t step = (remaining < WHEEL_TICK_NS) ? remaining : WHEEL_TICK_NS;
+        pthread_mutex_lock(&ctx->schedulerLock);
+        ctx->manualClockNs += step;
+        pthread_mutex_unlock(&ctx->schedulerLock);
+        remaining -= step;
+        schedulerTick(ctx);
+    }
+}
+
+
+/* -- Statistics -- */
+
+static int histogramBucket(uint64_t value)
+{
+    if (value < HISTOGRAM_SUB_BUCKETS) {
+        return (int)value;
+    }
+    int msb = 63 - __builtin_clzll(value);
+    int sub = (value >> (msb - 2)) & (HISTOGRAM_SUB_BUCKETS - 1);
+    return (msb - 1) * HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+// Largest value that goes in bucket
+static uint64_t histogramBucketLimit(int bucket)
+{
+    if (bucket < HISTOGRAM_SUB_BUCKETS - 1) {
+        return bucket;
+    }
+    if (bucket == HISTOGRAM_BUCKETS - 1) {
+        return UINT64_MAX;
+    }
+    // the lowest value of the next bucket, minus 1
+    int next = bucket + 1;
+    int msb = next / HISTOGRAM_SUB_BUCKETS + 1;
+    int sub = next % HISTOGRAM_SUB_BUCKETS;
+    return ((uint64_t)(HISTOGRAM_SUB_BUCKETS + sub) << (msb - 2)) - 1;
+}
+
+static void histogramRecord(histogram *h, uint64_t value)
+{
+    atomic_fetch_add_explicit(&h->counts[histogramBucket(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->total, 1, memory_order_relaxed);
+    uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    while ((value > max) && !atomic_compare_exchange_weak(&h->max, &max, value)) {
+    }
+}
+
+// Returns an upper bound for the given percentile (0-100), 0 if the histogram is empty
+static uint64_t histogramPercentile(histogram *h, double percentile)
+{
+    uint64_t total = atomic_load_explicit(&h->total, memory_order_relaxed);
+    if (total == 0) {
+        return 0;
+    }
+    uint64_t target = (uint64_t)ceil(total * percentile / 100.0);
+    if (target == 0) {
+        target = 1;
+    }
+    uint64_t count = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        count += atomic_load_explicit(&h->counts[i], memory_order_relaxed);
+        if (count >= target) {
+            uint64_t limit = histogramBucketLimit(i);
+            uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+            return (limit < max) ? limit : max;
+        }
+    }
+    return atomic_load_explicit(&h->max, memory_order_relaxed);
+}
+
+static void histogramReset(histogram *h)
+{
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        atomic_store_explicit(&h->counts[i], 0, memory_order_relaxed);
+    }
+    atomic_store_explicit(&h->total, 0, memory_order_relaxed);
+    atomic_store_explicit(&h->max, 0, memory_order_relaxed);
+}
+
+// Appends a line with the totals and note off latencies (times in µs)
+static void writeStats(emstContext *ctx, FILE *file)
+{
+    const flushStatistics *stats = &ctx->totalFlushStats;
+    uint64_t avgFlushTime = (stats->frames > 0) ? stats->flushTime / stats->frames / 1000 : 0;
+    fprintf(file, "time=%llu frames=%llu queued=%llu deduped=%llu sent=%llu delayed=%llu "
+            "avgflushtime=%llu maxflushtime=%llu pendingnoteoffs=%d "
+            "noteofflatency.count=%llu noteofflatency.p50=%llu noteofflatency.p99=%llu noteofflatency.max=%llu\n",
+            (unsigned long long)time(NULL), (unsigned long long)stats->frames,
+            (unsigned long long)stats->queued, (unsigned long long)stats->deduped,
+            (unsigned long long)stats->sent, (unsigned long long)stats->delayed,
+            (unsigned long long)avgFlushTime, (unsigned long long)(stats->maxFlushTime / 1000),
+            scheduledNoteOffCount(ctx),
+            (unsigned long long)atomic_load(&ctx->noteOffLatency.total),
+            (unsigned long long)histogramPercentile(&ctx->noteOffLatency, 50),
+            (unsigned long long)histogramPercentile(&ctx->noteOffLatency, 99),
+            (unsigned long long)atomic_load(&ctx->noteOffLatency.max));
+    fflush(file);
+}
+
+
+/* -- Output thread -- */
+// Batches published by midi_sendMessages() go through a lock-free single-producer/single-consumer
+// ring to the output thread, which hands them to the backend. Publishing is a copy and an atomic
+// store; the lock is only taken to wake the output thread if it's asleep because the ring was empty.
+
+#define OUTPUT_RING_SIZE (1 << 20)
+
+static void *outputThreadMain(void *arg)
+{
+    emstContext *ctx = arg;
+    uint8_t *record = NULL;
+    size_t recordSize = 0;
+    
+    while (true) {
+        size_t length;
+        while ((length = ringPeek(&ctx->outputRing)) > 0) {
+            if (length > recordSize) {
+                uint8_t *newRecord = realloc(record, length);
+                if (newRecord == NULL) {
+                    break; // try again after a nap
+                }
+                record = newRecord;
+                recordSize = length;
+            }
+            ringPop(&ctx->outputRing, record);
+            int port;
+            memcpy(&port, record, sizeof(port));
+            transportSend(ctx, port, record + sizeof(port), length - sizeof(port));
+            atomic_fetch_add(&ctx->outputBatchesSent, 1);
+        }
+        
+        pthread_mutex_lock(&ctx->outputThreadLock);
+        if (ctx->outputThreadStopping) {
+            pthread_mutex_unlock(&ctx->outputThreadLock);
+            break;
+        }
+        atomic_store(&ctx->outputThreadSleeping, true);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (ringPeek(&ctx->outputRing) == 0) {
+            pthread_cond_wait(&ctx->outputThreadWake, &ctx->outputThreadLock);
+        }
+        atomic_store(&ctx->outputThreadSleeping, false);
+        pthread_mutex_unlock(&ctx->outputThreadLock);
+    }
+    free(record);
+    return NULL;
+}
+
+// Pins the output thread to a CPU core, so it doesn't get migrated away from its caches while
+// the emulator is busy. On OS X this is only a hint, it sets an affinity tag.
+static void outputThreadPin(emstContext *ctx, int cpu)
+{
+#if defined(__linux__)
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    pthread_setaffinity_np(ctx->outputThread, sizeof(cpus), &cpus);
+#elif defined(__APPLE__)
+    thread_affinity_policy_data_t policy = {cpu + 1}; // tag 0 means no affinity
+    thread_policy_set(pthread_mach_thread_np(ctx->outputThread), THREAD_AFFINITY_POLICY,
+                      (thread_policy_t)&policy, THREAD_AFFINITY_POLICY_COUNT);
+#endif
+}
+
+static bool outputThreadStart(emstContext *ctx, int cpu)
+{
+    if (!ctx->outputThreadRunning) {
+        if (!ringInit(&ctx->outputRing, OUTPUT_RING_SIZE)) {
+            return false;
+        }
+        atomic_init(&ctx->outputThreadSleeping, false);
+        if (pthread_create(&ctx->outputThread, NULL, outputThreadMain, ctx) != 0) {
+            ringFree(&ctx->outputRing);
+            return false;
+        }
+        ctx->outputThreadRunning = true;
+    }
+    if (cpu >= 0) {
+        outputThreadPin(ctx, cpu);
+    }
+    return true;
+}
+
+static void outputThreadPublish(emstContext *ctx, int port, const uint8_t *bytes, size_t length)
+{
+    // The ring only fills up if the backend has stalled for a very long time, in which case
+    // the Lua thread has to wait, since dropping messages could leave notes stuck.
+    // each batch is prefixed with its port
+    while (!ringFits(&ctx->outputRing, sizeof(port) + length)) {
+        struct timespec nap = {0, 1000000};
+        nanosleep(&nap, NULL);
+    }
+    ringPushWithHeader(&ctx->outputRing, &port, sizeof(port), bytes, length);
+    ctx->outputBatchesPublished++;
+    
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&ctx->outputThreadSleeping)) {
+        pthread_mutex_lock(&ctx->outputThreadLock);
+        pthread_cond_signal(&ctx->outputThreadWake);
+        pthread_mutex_unlock(&ctx->outputThreadLock);
+    }
+}
+
+// Waits until every batch published has been handed to the backend: the output thread takes a
+// batch out of the ring before sending it, so an empty ring isn't enough
+static void outputThreadWaitUntilSent(emstContext *ctx)
+{
+    while (atomic_load(&ctx->outputBatchesSent) != ctx->outputBatchesPublished) {
+        struct timespec nap = {0, 1000000};
+        nanosleep(&nap, NULL);
+    }
+}
+
+// Stops the output thread once everything published has been sent
+static void outputThreadStop(emstContext *ctx)
+{
+    if (!ctx->outputThreadRunning) {
+        return;
+    }
+    pthread_mutex_lock(&ctx->outputThreadLock);
+    ctx->outputThreadStopping = true;
+    pthread_cond_signal(&ctx->outputThreadWake);
+    pthread_mutex_unlock(&ctx->outputThreadLock);
+    pthread_join(ctx->outputThread, NULL);
+    ringFree(&ctx->outputRing);
+    ctx->outputThreadRunning = false;
+}
+
+
+/* -- Recorder -- */
+// Every batch handed to the backend is also pushed to recorderRing, with the time it was sent
+// (on the scheduler's clock, so replays with MIDI.advanceclock() record the same file every
+// time). Pushes happen under transportLock, so the ring only ever has one producer. The recorder
+// thread appends each message to a temporary file for its channel, so nothing on the sending
+// side waits for the disk, and memory use doesn't grow with the length of the recording.
+// Stopping assembles the type 1 Standard MIDI File: a tempo track, then one track per channel
+// used. At 120 bpm with 500 ticks per quarter note, a tick is exactly 1ms.
+
+#define RECORDER_RING_SIZE (1 << 20)
+#define RECORDER_PPQ 500
+#define RECORDER_TEMPO 500000 // µs per quarter note (120 bpm)
+#define RECORDER_NS_PER_TICK ((uint64_t)RECORDER_TEMPO * 1000 / RECORDER_PPQ)
+#define RECORDER_POLL_NS 10000000 // the recorder thread checks the ring every 10ms
+#define SMF_MAX_DELTA 0x0FFFFFFF // largest delta time a 4 byte variable-length quantity can hold
+
+// Header of the records in recorderRing
+typedef struct {
+    uint64_t time;
+    int port;
+} recorderHeader;
+
+// Called by transportSend() with transportLock held. Never blocks: if the recorder thread falls
+// more than 1MB behind, batches are dropped from the recording.
+static void recorderPush(emstContext *ctx, int port, const uint8_t *bytes, size_t length)
+{
+    recorderHeader header = {schedulerNowNs(ctx), port};
+    ringPushWithHeader(&ctx->recorderRing, &header, sizeof(header), bytes, length);
+}
+
+static void recorderWriteBytes(emstContext *ctx, recorderTrack *track, const uint8_t *bytes, size_t length)
+{
+    if (fwrite(bytes, 1, length, track->events) != length) {
+        ctx->recorderFailed = true;
+    }
+    track->length += length;
+}
+
+// Writes the delta time since the track's last event and a 3 byte message
+static void recorderWriteEvent(emstContext *ctx, recorderTrack *track, uint64_t tick, const uint8_t *msg)
+{
+    uint64_t delta = (tick > track->lastTick) ? tick - track->lastTick : 0;
+    if (delta > SMF_MAX_DELTA) {
+        delta = SMF_MAX_DELTA;
+    }
+    track->lastTick += delta;
+    
+    // variable-length quantity: 7 bits per byte, most significant first, bit 7 set on all but the last
+    uint8_t event[4 + 3];
+    int length = 0;
+    for (int shift = 21; shift > 0; shift -= 7) {
+        if (delta >> shift) {
+            event[length++] = 0x80 | ((delta >> shift) & 0x7F);
+        }
+    }
+    event[length++] = delta & 0x7F;
+    memcpy(&event[length], msg, 3);
+    recorderWriteBytes(ctx, track, event, length + 3);
+}
+
+static recorderTrack *recorderTrackFor(emstContext *ctx, int ch)
+{
+    recorderTrack *track = &ctx->recorderTracks[ch];
+    if (track->events == NULL) {
+        track->events = tmpfile();
+        if (track->events == NULL) {
+            ctx->recorderFailed = true;
+            return NULL;
+        }
+        // name the track after its channel
+        char name[32];
+        int nameLength;
+        if (ctx->portCount > 1) {
+            nameLength = snprintf(name, sizeof(name), "Port %d Channel %d", CHANNEL_PORT(ch) + 1, CHANNEL_MIDI(ch) + 1);
+        } else {
+            nameLength = snprintf(name, sizeof(name), "Channel %d", ch + 1);
+        }
+        const uint8_t nameEvent[4] = {0x00, 0xFF, 0x03, nameLength};
+        recorderWriteBytes(ctx, track, nameEvent, sizeof(nameEvent));
+        recorderWriteBytes(ctx, track, (const uint8_t *)name, nameLength);
+        if (ctx->portCount > 1) {
+            // MIDI port meta event, so the tracks of different ports can be told apart
+            const uint8_t portEvent[5] = {0x00, 0xFF, 0x21, 0x01, CHANNEL_PORT(ch)};
+            recorderWriteBytes(ctx, track, portEvent, sizeof(portEvent));
+        }
+    }
+    return track;
+}
+
+// Appends the messages of one record (a header followed by a batch) to their channels' tracks
+static void recorderWriteRecord(emstContext *ctx, const uint8_t *record, size_t length)
+{
+    recorderHeader header;
+    memcpy(&header, record, sizeof(header));
+    uint64_t time = header.time;
+    uint64_t tick = (time > ctx->recorderStartNs) ? (time - ctx->recorderStartNs) / RECORDER_NS_PER_TICK : 0;
+    
+    for (size_t i = sizeof(header); i + 3 <= length; i += 3) {
+        const uint8_t *msg = &record[i];
+        recorderTrack *track = recorderTrackFor(ctx, header.port * 16 + (msg[0] & 0x0F));
+        if (track == NULL) {
+            continue;
+        }
+        recorderWriteEvent(ctx, track, tick, msg);
+        
+        uint64_t noteBit = 1ull << (msg[1] & 63);
+        if (((msg[0] & 0xF0) == 0x90) && (msg[2] > 0)) {
+            track->playingNotes[msg[1] >> 6] |= noteBit;
+        } else if ((msg[0] & 0xF0) == 0x80 || (msg[0] & 0xF0) == 0x90) {
+            track->playingNotes[msg[1] >> 6] &= ~noteBit;
+        }
+    }
+}
+
+static void *recorderThreadMain(void *arg)
+{
+    emstContext *ctx = arg;
+    struct timespec poll = {0, RECORDER_POLL_NS};
+    uint8_t *record = NULL;
+    size_t recordSize = 0;
+    
+    while (true) {
+        // checked before draining, so everything pushed before the stop gets written
+        bool stopping = atomic_load(&ctx->recorderStopping);
+        size_t length;
+        while ((length = ringPeek(&ctx->recorderRing)) > 0) {
+            if (length > recordSize) {
+                uint8_t *newRecord = realloc(record, length);
+                if (newRecord == NULL) {
+                    ctx->recorderFailed = true;
+                    free(record);
+                    return NULL;
+                }
+                record = newRecord;
+                recordSize = length;
+            }
+            ringPop(&ctx->recorderRing, record);
+            recorderWriteRecord(ctx, record, length);
+        }
+        if (stopping) {
+            break;
+        }
+        nanosleep(&poll, NULL);
+    }
+    free(record);
+    return NULL;
+}
+
+static void writeUint32BE(FILE *file, uint32_t value)
+{
+    const uint8_t bytes[4] = {value >> 24, value >> 16, value >> 8, value};
+    fwrite(bytes, 1, 4, file);
+}
+
+// Writes the Standard MIDI File from the channel tracks, turning off any note still playing at
+// the end of the recording. Returns false if anything couldn't be written.
+static bool recorderWriteFile(emstContext *ctx, uint64_t endTick)
+{
+    int trackCount = 1;
+    for (int ch = 0; ch < ctx->channelCount; ch++) {
+        recorderTrack *track = &ctx->recorderTracks[ch];
+        if (track->events == NULL) {
+            continue;
+        }
+        trackCount++;
+        for (int half = 0; half < 2; half++) {
+            while (track->playingNotes[half]) {
+                int note = (half << 6) | __builtin_ctzll(track->playingNotes[half]);
+                track->playingNotes[half] &= track->playingNotes[half] - 1;
+                const uint8_t noteOff[3] = {0x80 | CHANNEL_MIDI(ch), note, 0};
+                recorderWriteEvent(ctx, track, endTick, noteOff);
+            }
+        }
+    }
+    
+    const uint8_t endOfTrack[4] = {0x00, 0xFF, 0x2F, 0x00};
+    
+    // header: format 1, trackCount tracks, RECORDER_PPQ ticks per quarter note
+    fwrite("MThd", 1, 4, ctx->recorderFile);
+    writeUint32BE(ctx->recorderFile, 6);
+    const uint8_t header[6] = {0, 1, trackCount >> 8, trackCount, RECORDER_PPQ >> 8, RECORDER_PPQ & 0xFF};
+    fwrite(header, 1, sizeof(header), ctx->recorderFile);
+    
+    // tempo track
+    const uint8_t tempo[7] = {0x00, 0xFF, 0x51, 0x03, RECORDER_TEMPO >> 16, (RECORDER_TEMPO >> 8) & 0xFF,
+                              RECORDER_TEMPO & 0xFF};
+    fwrite("MTrk", 1, 4, ctx->recorderFile);
+    writeUint32BE(ctx->recorderFile, sizeof(tempo) + sizeof(endOfTrack));
+    fwrite(tempo, 1, sizeof(tempo), ctx->recorderFile);
+    fwrite(endOfTrack, 1, sizeof(endOfTrack), ctx->recorderFile);
+    
+    // channel tracks
+    for (int ch = 0; ch < ctx->channelCount; ch++) {
+        recorderTrack *track = &ctx->recorderTracks[ch];
+        if (track->events == NULL) {
+            continue;
+        }
+        fwrite("MTrk", 1, 4, ctx->recorderFile);
+        writeUint32BE(ctx->recorderFile, track->length + sizeof(endOfTrack));
+        rewind(track->events);
+        uint8_t buffer[8192];
+        size_t length;
+        while ((length = fread(buffer, 1, sizeof(buffer), track->events)) > 0) {
+            fwrite(buffer, 1, length, ctx->recorderFile);
+        }
+        fwrite(endOfTrack, 1, sizeof(endOfTrack), ctx->recorderFile);
+    }
     
-    return 0;
+    return !ctx->recorderFailed && (fflush(ctx->recorderFile) == 0) && !ferror(ctx->recorderFile);
 }
 
-// MIDI.allnotesoff([channel = 1])
-// channel (optional): integer 1-16 
-static int midi_allnotesoff(lua_State *L)
+static bool recorderStart(emstContext *ctx, FILE *file)
 {
-    int args = lua_gettop(L);
-    if (args > 1) {
-        return luaL_error(L, "Invalid number of arguments to MIDI.allnotesoff()");
-    }
-    
-    if (!initcheck()) {
-        return luaL_error(L, "Must call MIDI.init() before MIDI.allnotesoff()");
+    if (!ctx->recorderRingAllocated) {
+        if (!ringInit(&ctx->recorderRing, RECORDER_RING_SIZE)) {
+            return false;
+        }
+        ctx->recorderRingAllocated = true;
     }
     
-    int channel = 0;
-    if (args == 1) {
-        channel = luaL_checkinteger(L, 1);
-        // Channel argument is in range 1-16, subtract 1 for zero-indexed channel.
-        // Argument of '0' will still go to zero-indexed channel 0.
-        channel--;
-        if (channel < 0) channel = 0;
-        if (channel > 15) channel = 15;
+    memset(ctx->recorderTracks, 0, ctx->channelCount * sizeof(*ctx->recorderTracks));
+    ctx->recorderFailed = false;
+    atomic_store(&ctx->recorderStopping, false);
+    if (pthread_create(&ctx->recorderThread, NULL, recorderThreadMain, ctx) != 0) {
+        return false;
     }
+    ctx->recorderFile = file;
     
-    command resetNotesCommand;
-    resetNotesCommand.type = kResetNotes;
-    resetNotesCommand.channel = channel;
-    queueCommand(resetNotesCommand);
-        
-    return 0;
+    pthread_mutex_lock(&ctx->transportLock);
+    ctx->recorderStartNs = schedulerNowNs(ctx);
+    ctx->recording = true;
+    pthread_mutex_unlock(&ctx->transportLock);
+    return true;
 }
 
-// MIDI.sendmessages()
-// No arguments
-static int midi_sendMessages(lua_State *L)
+// Stops recording, waits for the recorder thread to catch up, and writes the file.
+// Returns false if the recording couldn't be written completely.
+static bool recorderStop(emstContext *ctx)
 {
-    if (!initcheck()) {
-        return luaL_error(L, "Must call MIDI.init() before MIDI.sendmessages()");
+    // everything already published to the output thread should be in the recording
+    if (ctx->lookahead > 0) {
+        lookaheadWaitUntilSent(ctx);
+    }
+    if (ctx->flushBatch.sink != transportSend) {
+        outputThreadWaitUntilSent(ctx);
     }
     
-    int messagesSent = commandQueueIndex; // for debugging    
-    
-    // Used to remove redundant (possibly contradictory) events
-    uint16_t noteOns[128];
-    uint16_t noteOffs[128];
-    uint16_t CCs[128];
+    pthread_mutex_lock(&ctx->transportLock);
+    ctx->recording = false;
+    uint64_t endTime = schedulerNowNs(ctx);
+    pthread_mutex_unlock(&ctx->transportLock);
     
-    memset(noteOns, 0, 128 * sizeof(uint16_t));
-    memset(noteOffs, 0, 128 * sizeof(uint16_t));
-    memset(CCs, 0, 128 * sizeof(uint16_t));
-    uint16_t notesReset = 0; // remove all note on commands before reset notes command
-    uint16_t pitchBends = 0; // remove all but the last pitch bend command for each channel
+    atomic_store(&ctx->recorderStopping, true);
+    pthread_join(ctx->recorderThread, NULL);
     
-    // how many notes need to be sent slightly later due to concurrent note off commands?
-    int laterNotes = 0;
+    uint64_t endTick = (endTime > ctx->recorderStartNs) ? (endTime - ctx->recorderStartNs) / RECORDER_NS_PER_TICK : 0;
+    bool written = recorderWriteFile(ctx, endTick);
+    if (atomic_load(&ctx->recorderRing.dropped) > 0) {
+        written = false;
+        atomic_store(&ctx->recorderRing.dropped, 0);
+    }
     
-    // 1: Run through backwards, remove superfluous commands
-    for (int i = commandQueueIndex - 1; i >= 0; i--) {
-        int ch = commandQueue[i].channel;
-        switch(commandQueue[i].type) {
-            case kNoteOn:
-            case kNoteOnWithDuration:
-            {
-                int note = commandQueue[i].note;
-                if (((noteOffs[note] >> ch) & 1) == 1) {
-                    // note off exists later in queue, remove me
-                    commandQueue[i].type = kInvalid;
-                    messagesSent--;
-                    break;
-                }
-                if (((noteOns[note] >> ch) & 1) == 1) {
-                    // note on already exists later in the queue, remove me
-                    commandQueue[i].type = kInvalid;
-                    messagesSent--;
-                    break;
-                }
-                if (((notesReset >> ch) & 1) == 1) {
-                    // reset notes command exists later in the queue, remove me
-                    commandQueue[i].type = kInvalid;
-                    messagesSent--;
-                    break;
-                }
-                noteOns[note] |= (1 << ch);
-                if (notePlaying[ch][note]) {
-                    laterNotes++;
-                }
-                break;
-            }
-            case kNoteOff:
-            {
-                int note = commandQueue[i].note;
-                noteOffs[note] |= (1 << ch);
-                break;
-            }
-            case kCC:
-            {
-                int cc = commandQueue[i].CC;
-                if (((CCs[cc] >> ch) & 1) == 1) {
-                    commandQueue[i].type = kInvalid;
-                    messagesSent--;
-                    break;
-                }
-                CCs[cc] |= (1 << ch);
-                break;
-            }
-            case kPitchBend:
-                if (((pitchBends >> ch) & 1) == 1) {
-                    commandQueue[i].type = kInvalid;
-                    messagesSent--;
-                    break;
-                }
-                pitchBends |= (1 << ch);
-                break;
-            case kResetNotes:
-                notesReset |= (1 << ch);
-                break;
-            default:
-                break;
+    for (int ch = 0; ch < ctx->channelCount; ch++) {
+        if (ctx->recorderTracks[ch].events != NULL) {
+            fclose(ctx->recorderTracks[ch].events); // temporary files are deleted when closed
+            ctx->recorderTracks[ch].events = NULL;
         }
     }
-    
-    // 2: Run through commands, move note on commands for already-playing notes to a delayed list.
-    // This may be necessary because if a note off is sent at the same time as a note on, it ends 
-    // up having the same timestamp as the note on event, and they might cancel each other out, as the
-    // order of events with the same timestamp apparently can vary.
-    command *delayedCommands = malloc(laterNotes * sizeof(command));
-    int delayedCommandsIndex = 0;
-    for (int i = 0; i < commandQueueIndex; i++) {
-        if ((commandQueue[i].type == kNoteOn) || (commandQueue[i].type == kNoteOnWithDuration)) {
-            int ch = commandQueue[i].channel;
-            int note = commandQueue[i].note;
-            if (notePlaying[ch][note]) {
-                delayedCommands[delayedCommandsIndex] = commandQueue[i];
-                delayedCommandsIndex++;
-                // We need to turn off the note since it's already playing
-                commandQueue[i].type = kNoteOff;
-            }
+    if (fclose(ctx->recorderFile) != 0) {
+        written = false;
+    }
+    ctx->recorderFile = NULL;
+    return written;
+}
+
+// Makes sure the files are complete if the emulator exits while recording
+static void recorderStopAtExit(void)
+{
+    pthread_mutex_lock(&openContextsLock);
+    for (emstContext *ctx = openContexts; ctx != NULL; ctx = ctx->next) {
+        if (ctx->recorderFile != NULL) {
+            recorderStop(ctx);
+        }
+    }
+    pthread_mutex_unlock(&openContextsLock);
+}
+
+
+/* -- Transport backends -- */
+
+// Each port has its own lock, so batches for different ports can be sent by different threads
+// at the same time. The recorder is shared by all ports, so pushing to it takes transportLock
+// (recording is checked again under the lock, since it can be turned off in between).
+static void transportSend(emstContext *ctx, int port, const uint8_t *bytes, size_t length)
+{
+    pthread_mutex_lock(&ctx->ports[port].lock);
+    ctx->transport->send(ctx, port, bytes, length);
+    pthread_mutex_unlock(&ctx->ports[port].lock);
+    if (atomic_load_explicit(&ctx->recording, memory_order_relaxed)) {
+        pthread_mutex_lock(&ctx->transportLock);
+        if (ctx->recording) {
+            recorderPush(ctx, port, bytes, length);
+        }
+        pthread_mutex_unlock(&ctx->transportLock);
+    }
+}
+
+#ifdef __APPLE__
+// CoreMIDI backend: a virtual MIDI source that other applications can connect to
+
+// One client per context, with a source for each port
+static bool coreMIDIOpen(emstContext *ctx, int port, const char *endpointName)
+{
+    if (port == 0) {
+        MIDIClientCreate(CFSTR("EnstrumentMIDIClient"), NULL, NULL, &ctx->luaMIDIClient);
+        if (!ctx->luaMIDIClient) {
+            return false;
+        }
+    }
+    CFStringRef name = CFStringCreateWithCString(NULL, endpointName, kCFStringEncodingUTF8);
+    MIDISourceCreate(ctx->luaMIDIClient, name, &ctx->ports[port].endpoint);
+    CFRelease(name);
+    if (!ctx->ports[port].endpoint) {
+        if (port == 0) {
+            MIDIClientDispose(ctx->luaMIDIClient);
+        }
+        return false;
+    }
+    return true;
+}
+
+// Packs the whole batch into one MIDIPacketList (all with timestamp 0, so CoreMIDI merges them
+// into a single packet) and sends it with one MIDIReceived() call. The list's buffer grows to fit
+// the largest batch seen so far; if that fails, the batch is sent in several lists.
+static void coreMIDISend(emstContext *ctx, int port, const uint8_t *bytes, size_t length)
+{
+    outputPort *output = &ctx->ports[port];
+    ByteCount needed = sizeof(MIDIPacketList) + length;
+    if (output->packetListBufferSize < needed) {
+        Byte *buffer = realloc(output->packetListBuffer, needed);
+        if (buffer != NULL) {
+            output->packetListBuffer = buffer;
+            output->packetListBufferSize = needed;
+        } else if (output->packetListBuffer == NULL) {
+            return;
         }
     }
     
-    // 3. Send messages for events remaining in commandQueue
-    for (int i = 0; i < commandQueueIndex; i++) {
-        switch (commandQueue[i].type) {
-            case kNoteOn:
-                sendNoteOn(commandQueue[i].channel, commandQueue[i].note, commandQueue[i].velocity);
-                break;
-            case kNoteOnWithDuration:
-                sendNoteOnWithDuration(commandQueue[i].channel, commandQueue[i].note, 
-                            commandQueue[i].velocity, commandQueue[i].duration, 0);
-                break;
-            case kNoteOff:
-                sendNoteOff(commandQueue[i].channel, commandQueue[i].note);
-                break;
-            case kCC:
-                sendCC(commandQueue[i].channel, commandQueue[i].CC, commandQueue[i].value);
+    MIDIPacketList *packetList = (MIDIPacketList *)output->packetListBuffer;
+    MIDIPacket *packet = MIDIPacketListInit(packetList);
+    for (size_t i = 0; i < length; i += 3) {
+        MIDIPacket *next = MIDIPacketListAdd(packetList, output->packetListBufferSize, packet, 0, 3, &bytes[i]);
+        if (next == NULL) {
+            MIDIReceived(output->endpoint, packetList);
+            packet = MIDIPacketListInit(packetList);
+            next = MIDIPacketListAdd(packetList, output->packetListBufferSize, packet, 0, 3, &bytes[i]);
+        }
+        packet = next;
+    }
+    MIDIReceived(output->endpoint, packetList);
+}
+
+static void coreMIDIClose(emstContext *ctx, int port)
+{
+    MIDIEndpointDispose(ctx->ports[port].endpoint);
+    free(ctx->ports[port].packetListBuffer);
+    if (port == 0) {
+        MIDIClientDispose(ctx->luaMIDIClient);
+    }
+}
+#endif
+
+#ifdef EMSTRUMENT_ALSA
+// ALSA sequencer backend: a sequencer client with one output port, which other clients can
+// subscribe to (e.g. with aconnect), like CoreMIDI's virtual source. Events are sent directly
+// (not through a sequencer queue), and the whole batch is written with one drain. Each port has
+// its own client, since a client's output buffer can't be written by two threads at once.
+#define ALSA_OUTPUT_BUFFER_SIZE (64 * 1024) // room for about 2000 events before a drain is forced
+
+static bool alsaOpen(emstContext *ctx, int port, const char *endpointName)
+{
+    outputPort *output = &ctx->ports[port];
+    if (snd_seq_open(&output->seq, "default", SND_SEQ_OPEN_OUTPUT, 0) < 0) {
+        return false;
+    }
+    // named after the port, except for the default context's ports ("EmstrumentMIDIClient 2" etc.)
+    size_t prefix = strlen(ENDPOINT_NAME);
+    if (strncmp(endpointName, ENDPOINT_NAME, prefix) == 0) {
+        char clientName[64];
+        snprintf(clientName, sizeof(clientName), "EmstrumentMIDIClient%s", endpointName + prefix);
+        snd_seq_set_client_name(output->seq, clientName);
+    } else {
+        snd_seq_set_client_name(output->seq, endpointName);
+    }
+    output->alsaPort = snd_seq_create_simple_port(output->seq, endpointName,
+                                          SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ,
+                                          SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+    if (output->alsaPort < 0) {
+        snd_seq_close(output->seq);
+        output->seq = NULL;
+        return false;
+    }
+    snd_seq_set_output_buffer_size(output->seq, ALSA_OUTPUT_BUFFER_SIZE);
+    return true;
+}
+
+static void alsaSend(emstContext *ctx, int port, const uint8_t *bytes, size_t length)
+{
+    outputPort *output = &ctx->ports[port];
+    snd_seq_event_t ev;
+    for (size_t i = 0; i + 2 < length; i += 3) {
+        int ch = bytes[i] & 0x0F;
+        snd_seq_ev_clear(&ev);
+        switch (bytes[i] & 0xF0) {
+            case 0x90:
+                snd_seq_ev_set_noteon(&ev, ch, bytes[i + 1], bytes[i + 2]);
                 break;
-            case kPitchBend:
-                sendPitchBend(commandQueue[i].channel, commandQueue[i].MS7b, commandQueue[i].LS7b);
+            case 0x80:
+                snd_seq_ev_set_noteoff(&ev, ch, bytes[i + 1], bytes[i + 2]);
                 break;
-            case kResetNotes:
-                sendResetNotes(commandQueue[i].channel);
+            case 0xB0:
+                snd_seq_ev_set_controller(&ev, ch, bytes[i + 1], bytes[i + 2]);
                 break;
-            default: // covers -1/invalid
+            case 0xE0:
+                // ALSA pitch bend values are signed, centered on 0 instead of 0x2000
+                snd_seq_ev_set_pitchbend(&ev, ch, ((bytes[i + 2] << 7) | bytes[i + 1]) - 0x2000);
                 break;
+            default: // Emstrument doesn't send anything else
+                continue;
         }
+        snd_seq_ev_set_source(&ev, output->alsaPort);
+        snd_seq_ev_set_subs(&ev);
+        snd_seq_ev_set_direct(&ev);
+        // only blocks (draining the buffer) if the batch doesn't fit in the output buffer
+        snd_seq_event_output(output->seq, &ev);
     }
-    
-    // 4. Send messages for note on commands in delatedCommands in a deferred block, release list.
-    // For anyone interested in porting Emstrument, this need to be modified to use something else equivalent to GCD.
-    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, 1000000 * late_note_offset), luaMIDIQueue, ^{
-        // send commands
-        for (int i = 0; i < delayedCommandsIndex; i++) {
-            switch (delayedCommands[i].type) {
-                case kNoteOn:
-                    //printf("sending delated note on\n");
-                    sendNoteOn(delayedCommands[i].channel, delayedCommands[i].note, 
-                                delayedCommands[i].velocity);
-                    break;
-                case kNoteOnWithDuration:
-                    //printf("sending delated note on w/ duration\n");
-                    sendNoteOnWithDuration(delayedCommands[i].channel, delayedCommands[i].note, 
-                                delayedCommands[i].velocity, delayedCommands[i].duration, late_note_offset);
-                    break;
-                default: // shouldn't be any other commands, but just in case
-                    break;
-            }
-        }    
-        free(delayedCommands);
-    });
-    
-    commandQueueIndex = 0;
+    snd_seq_drain_output(output->seq);
+}
 
-    return 0;
+static void alsaClose(emstContext *ctx, int port)
+{
+    snd_seq_close(ctx->ports[port].seq);
+    ctx->ports[port].seq = NULL;
 }
+#endif
 
-static const struct luaL_reg kMidilib[] = {
-    {"init", midi_init},
-    {"configuretiming", midi_configuretiming},
-    {"notenumber", midi_noteNumber},
-    {"noteon", midi_noteon},
-    {"noteoff", midi_noteoff},
-    {"noteonwithduration", midi_noteonwithduration},
-    {"CC", midi_CC},
-    {"pitchbend", midi_pitchbend},
-    {"allnotesoff", midi_allnotesoff},
-    {"sendmessages", midi_sendMessages},
-    {NULL,NULL}
-};
+static bool ringInit(byteRing *ring, size_t size)
+{
+    ring->buffer = malloc(size);
+    ring->size = size;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->dropped, 0);
+    return (ring->buffer != NULL);
+}
 
-LUALIB_API int luaopen_emstrument (lua_State *L) {
-  luaL_register(L, "MIDI", kMidilib);
-  return 0;
+static void ringFree(byteRing *ring)
+{
+    free(ring->buffer);
+    ring->buffer = NULL;
 }
 
+static void ringCopyIn(byteRing *ring, size_t position, const void *src, size_t length)
+{
+    size_t offset = position & (ring->size - 1);
+    size_t first = (length < ring->size - offset) ? length : ring->size - offset;
+    memcpy(&ring->buffer[offset], src, first);
+    memcpy(ring->buffer, (const uint8_t *)src + first, length - first);
+}
+
+static void ringCopyOut(byteRing *ring, size_t position, void *dst, size_t length)
+{
+    size_t offset = position & (ring->size - 1);
+    size_t first = (length < ring->size - offset) ? length : ring->size - offset;
+    memcpy(dst, &ring->buffer[offset], first);
+    memcpy((uint8_t *)dst + first, ring->buffer, length - first);
+}
 
-/* -- MIDI sending functions (only to be called from midi_sendMessages()) -- */
-// For anyone interested in porting Emstrument, these are the core functions that need to be modified.
+// Producer side. Returns whether a record of length bytes (header included) fits in the ring
+// right now. Producers that wait for room check this first, so waiting isn't counted as dropping.
+static bool ringFits(byteRing *ring, size_t length)
+{
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    return ring->size - (head - tail) >= sizeof(uint32_t) + length;
+}
 
-static void sendNoteOn(int ch, int note, int vel)
+// Producer side. Pushes one record made of header followed by bytes (header can be empty).
+// Never blocks: returns false (and counts the record as dropped) if it doesn't fit.
+static bool ringPushWithHeader(byteRing *ring, const void *header, size_t headerLength,
+                               const uint8_t *bytes, size_t length)
 {
-    Byte buffer[32];
-    MIDIPacketList *packetlist = (MIDIPacketList *)buffer;
-    MIDIPacket *currentpacket = MIDIPacketListInit(packetlist);
-    
-    // Update lastNoteIDs before sending out the MIDI message
-    lastNoteIDs[ch][note]++;
-        
-    Byte onbytes[3] = {0x90 + ch, note, vel};
-    currentpacket = MIDIPacketListAdd(packetlist, sizeof(buffer), currentpacket, 0, 3, onbytes);
-    MIDIReceived(luaMIDIEndpoint, packetlist);
-    
-    notePlaying[ch][note] = true;
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t recordLength = (uint32_t)(headerLength + length);
+    if (!ringFits(ring, recordLength)) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return false;
+    }
+    ringCopyIn(ring, head, &recordLength, sizeof(recordLength));
+    if (headerLength > 0) {
+        ringCopyIn(ring, head + sizeof(recordLength), header, headerLength);
+    }
+    ringCopyIn(ring, head + sizeof(recordLength) + headerLength, bytes, length);
+    atomic_store_explicit(&ring->head, head + sizeof(recordLength) + recordLength, memory_order_release);
+    return true;
 }
 
-// offset reduces the duration to account for if this message is part of the delayed command list
-// and note-on delay is set above 0
-static void sendNoteOnWithDuration(int ch, int note, int vel, int duration, float offset)
+static bool ringPush(byteRing *ring, const uint8_t *bytes, size_t length)
 {
-    Byte buffer[32];
-    MIDIPacketList *packetlist = (MIDIPacketList *)buffer;
-    MIDIPacket *currentpacket = MIDIPacketListInit(packetlist);
+    return ringPushWithHeader(ring, NULL, 0, bytes, length);
+}
 
-    // Update lastNoteIDs before sending out the MIDI message
-    lastNoteIDs[ch][note]++;
-    int currentNoteID = lastNoteIDs[ch][note];
-        
-    Byte onbytes[3] = {0x90 + ch, note, vel};
-    currentpacket = MIDIPacketListAdd(packetlist, sizeof(buffer), currentpacket, 0, 3, onbytes);
-    MIDIReceived(luaMIDIEndpoint, packetlist); 
+// Consumer side. Returns the length of the next record (0 if the ring is empty) without
+// removing it.
+static size_t ringPeek(byteRing *ring)
+{
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (head == tail) {
+        return 0;
+    }
+    uint32_t recordLength;
+    ringCopyOut(ring, tail, &recordLength, sizeof(recordLength));
+    return recordLength;
+}
 
-    notePlaying[ch][note] = true;
-    
-    // note off scheduling, the using a timestamp with MIDIReceived() doesn't seem to work all the time
-    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, 1000000 * duration_unit * (duration - offset)), 
-        luaMIDIQueue, ^{
-        // If the same note has been played since this one, don't send
-        // note off message (it's already been turned off)
-        if (lastNoteIDs[ch][note] == currentNoteID) {
-            Byte buffer_d[32];
-            MIDIPacketList *packetlist_d = (MIDIPacketList *)buffer_d;
-            MIDIPacket *currentpacket_d = MIDIPacketListInit(packetlist_d);
-            
-            Byte offbytes[3] = {0x80 + ch, note, 0};
-            MIDIPacketListAdd(packetlist_d, sizeof(buffer_d), currentpacket_d, 0, 3, offbytes);
-            MIDIReceived(luaMIDIEndpoint, packetlist_d);
-            
-            notePlaying[ch][note] = false;
+// Consumer side. Copies the first length bytes of the next record to dst without removing it.
+static void ringPeekData(byteRing *ring, void *dst, size_t length)
+{
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    ringCopyOut(ring, tail + sizeof(uint32_t), dst, length);
+}
+
+// Consumer side. Removes the next record, copying it to dst, which must fit ringPeek() bytes.
+static void ringPop(byteRing *ring, uint8_t *dst)
+{
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t recordLength;
+    ringCopyOut(ring, tail, &recordLength, sizeof(recordLength));
+    ringCopyOut(ring, tail + sizeof(recordLength), dst, recordLength);
+    atomic_store_explicit(&ring->tail, tail + sizeof(recordLength) + recordLength, memory_order_release);
+}
+
+// Ring buffer backend: keeps every batch in memory (one ring per port), so that a test harness
+// can read them back with MIDI.drain() and time the send path without a MIDI server running.
+#define RINGBUFFER_BACKEND_SIZE (1 << 20)
+
+static bool ringBackendOpen(emstContext *ctx, int port, const char *endpointName)
+{
+    return ringInit(&ctx->ports[port].ring, RINGBUFFER_BACKEND_SIZE);
+}
+
+static void ringBackendSend(emstContext *ctx, int port, const uint8_t *bytes, size_t length)
+{
+    ringPush(&ctx->ports[port].ring, bytes, length);
+}
+
+static void ringBackendClose(emstContext *ctx, int port)
+{
+    ringFree(&ctx->ports[port].ring);
+}
+
+// Shared memory backend: writes every batch to a lock-free ring in a POSIX shared memory object,
+// for a consumer in another process (see emstrument_shm.h for the layout, and
+// tools/shm_consumer.c). Sending a batch is a clock read (see schedulerClockNs()), a copy and an
+// atomic store, without taking any lock.
+#define SHM_BACKEND_SIZE (1 << 20)
+
+// The object's name: '/' and the endpoint's name, with anything unusual replaced by '_'
+static void shmBackendName(char *name, const char *endpointName)
+{
+    size_t length = 0;
+    name[length++] = '/';
+    for (const char *c = endpointName; (*c != '\0') && (length < EMST_SHM_NAME_MAX - 1); c++) {
+        bool plain = ((*c >= 'a') && (*c <= 'z')) || ((*c >= 'A') && (*c <= 'Z')) ||
+                     ((*c >= '0') && (*c <= '9')) || (*c == '-') || (*c == '_');
+        name[length++] = plain ? *c : '_';
+    }
+    name[length] = '\0';
+}
+
+// The default context is never closed, so its objects (and those of any instance still open)
+// are marked closed and removed when the process exits, like a closed port's
+static void shmBackendCloseAtExit(void)
+{
+    const transportBackend *backend = findBackend("shm");
+    pthread_mutex_lock(&openContextsLock);
+    for (emstContext *ctx = openContexts; ctx != NULL; ctx = ctx->next) {
+        if (ctx->transport != backend) {
+            continue;
+        }
+        for (int port = 0; port < ctx->portCount; port++) {
+            // not unmapped, the threads may still be sending
+            atomic_store_explicit(&ctx->ports[port].shm->closed, 1, memory_order_release);
+            shm_unlink(ctx->ports[port].shmName);
         }
-    });
+    }
+    pthread_mutex_unlock(&openContextsLock);
 }
 
-static void sendNoteOff(int ch, int note)
+static bool shmBackendOpen(emstContext *ctx, int port, const char *endpointName)
 {
-    Byte buffer[32];
-    MIDIPacketList *packetlist = (MIDIPacketList *)buffer;
-    MIDIPacket *currentpacket = MIDIPacketListInit(packetlist);
+    outputPort *output = &ctx->ports[port];
+    shmBackendName(output->shmName, endpointName);
+    
+    // a leftover object (from a process that crashed) is replaced, and marked closed so that
+    // consumers still reading it move on to the new one
+    int oldFd = shm_open(output->shmName, O_RDWR, 0);
+    if (oldFd >= 0) {
+        struct stat info;
+        if ((fstat(oldFd, &info) == 0) && ((size_t)info.st_size >= sizeof(emstShmHeader))) {
+            emstShmHeader *old = mmap(NULL, sizeof(emstShmHeader), PROT_READ | PROT_WRITE, MAP_SHARED, oldFd, 0);
+            if (old != MAP_FAILED) {
+                atomic_store_explicit(&old->closed, 1, memory_order_release);
+                munmap(old, sizeof(emstShmHeader));
+            }
+        }
+        close(oldFd);
+        shm_unlink(output->shmName);
+    }
+    int fd = shm_open(output->shmName, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        return false;
+    }
+    size_t headerSize = (sizeof(emstShmHeader) + 63) & ~(size_t)63;
+    size_t size = headerSize + SHM_BACKEND_SIZE;
+    void *memory = MAP_FAILED;
+    if (ftruncate(fd, size) == 0) {
+        memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd); // the mapping stays
+    if (memory == MAP_FAILED) {
+        shm_unlink(output->shmName);
+        return false;
+    }
     
-    Byte offbytes[3] = {0x80 + ch, note, 100};
-    currentpacket = MIDIPacketListAdd(packetlist, sizeof(buffer), currentpacket, 0, 3, offbytes);
-    MIDIReceived(luaMIDIEndpoint, packetlist);
+    emstShmHeader *header = memory;
+    header->version = EMST_SHM_VERSION;
+    header->headerSize = headerSize;
+    header->capacity = SHM_BACKEND_SIZE;
+    atomic_init(&header->closed, 0);
+    atomic_init(&header->head, 0);
+    atomic_init(&header->tail, 0);
+    atomic_init(&header->dropped, 0);
+    // consumers only look at the rest once the magic number is there
+    atomic_thread_fence(memory_order_release);
+    header->magic = EMST_SHM_MAGIC;
     
-    notePlaying[ch][note] = false;
+    output->shm = header;
+    output->shmSize = size;
+    
+    static bool closeAtExitRegistered = false;
+    if (!closeAtExitRegistered) {
+        atexit(shmBackendCloseAtExit);
+        closeAtExitRegistered = true;
+    }
+    return true;
 }
 
-static void sendCC(int ch, int CC, int value)
+static void shmBackendSend(emstContext *ctx, int port, const uint8_t *bytes, size_t length)
 {
-    Byte buffer[32];
-    MIDIPacketList *packetlist = (MIDIPacketList *)buffer;
-    MIDIPacket *currentpacket = MIDIPacketListInit(packetlist);
+    emstShmHeader *header = ctx->ports[port].shm;
+    uint64_t capacity = header->capacity;
+    uint64_t recordSize = EMST_SHM_RECORD_SIZE(length);
+    uint64_t head = atomic_load_explicit(&header->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&header->tail, memory_order_acquire);
+    
+    // records don't wrap around: skip the end of the data area if the record doesn't fit there
+    uint64_t offset = head & (capacity - 1);
+    uint64_t skipped = (capacity - offset < recordSize) ? capacity - offset : 0;
+    if (capacity - (head - tail) < skipped + recordSize) {
+        atomic_fetch_add_explicit(&header->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    uint8_t *data = emstShmData(header);
+    if (skipped > 0) {
+        *(uint32_t *)&data[offset] = EMST_SHM_WRAP;
+        offset = 0;
+    }
     
-    Byte msg[3] = {0xB0 + ch, CC, value};
-    currentpacket = MIDIPacketListAdd(packetlist, sizeof(buffer), currentpacket, 0, 3, msg);
-    MIDIReceived(luaMIDIEndpoint, packetlist);
+    emstShmRecord record = {(uint32_t)length, 0, schedulerClockNs(ctx)};
+    memcpy(&data[offset], &record, sizeof(record));
+    memcpy(&data[offset + sizeof(record)], bytes, length);
+    atomic_store_explicit(&header->head, head + skipped + recordSize, memory_order_release);
 }
 
-static void sendPitchBend(int ch, int msb, int lsb)
+static void shmBackendClose(emstContext *ctx, int port)
 {
-    Byte buffer[32];
-    MIDIPacketList *packetlist = (MIDIPacketList *)buffer;
-    MIDIPacket *currentpacket = MIDIPacketListInit(packetlist);
-    
-    Byte offbytes[3] = {0xE0 + ch, lsb, msb};
-    currentpacket = MIDIPacketListAdd(packetlist, sizeof(buffer), currentpacket, 0, 3, offbytes);
-    MIDIReceived(luaMIDIEndpoint, packetlist);
+    outputPort *output = &ctx->ports[port];
+    atomic_store_explicit(&output->shm->closed, 1, memory_order_release);
+    munmap(output->shm, output->shmSize);
+    shm_unlink(output->shmName);
+    output->shm = NULL;
+}
+
+// OSC backend: sends each batch as one OSC bundle in a UDP datagram, to the address set with
+// MIDI.configureosc(). A flush (or a scheduler tick) is one batch per port, so receivers get
+// everything that happened in a frame at once, timetagged with the time it was sent. Each
+// message is an OSC message with integer arguments, see the documentation of MIDI.init().
+// Sockets are non-blocking: if the socket buffer is full, the bundle is lost rather than
+// holding up the emulator.
+#define OSC_MAX_DATAGRAM 65507 // largest UDP payload, bigger batches are split into several bundles
+#define OSC_ADDRESS_PREFIX "/emstrument/"
+#define NTP_UNIX_OFFSET 2208988800u // seconds from 1900 (NTP's epoch, used by OSC) to 1970
+
+static void oscDefaultAddress(emstContext *ctx)
+{
+    struct sockaddr_in *address = (struct sockaddr_in *)&ctx->oscAddress;
+    memset(&ctx->oscAddress, 0, sizeof(ctx->oscAddress));
+    address->sin_family = AF_INET;
+    address->sin_port = htons(OSC_DEFAULT_PORT);
+    inet_pton(AF_INET, OSC_DEFAULT_HOST, &address->sin_addr);
+    ctx->oscAddressLength = sizeof(*address);
+}
+
+// Opens a socket for the current address's family on one of the context's ports
+static bool oscOpenSocket(emstContext *ctx, int port)
+{
+    int fd = socket(ctx->oscAddress.ss_family, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        return false;
+    }
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    if (ctx->ports[port].oscSocket >= 0) {
+        close(ctx->ports[port].oscSocket);
+    }
+    ctx->ports[port].oscSocket = fd;
+    return true;
+}
+
+// Changes the address of every port, with their locks held so nothing is being sent meanwhile.
+// If the ports are open and the new address is from another family, they get new sockets.
+static bool oscSetAddress(emstContext *ctx, const struct sockaddr *address, socklen_t length)
+{
+    if (length > sizeof(ctx->oscAddress)) {
+        return false;
+    }
+    bool ok = true;
+    for (int port = 0; port < MAX_PORTS; port++) {
+        pthread_mutex_lock(&ctx->ports[port].lock);
+    }
+    bool familyChanged = (address->sa_family != ctx->oscAddress.ss_family);
+    memcpy(&ctx->oscAddress, address, length);
+    ctx->oscAddressLength = length;
+    if (familyChanged && (ctx->transport == findBackend("osc"))) {
+        for (int port = 0; port < ctx->portCount; port++) {
+            ok = oscOpenSocket(ctx, port) && ok;
+        }
+    }
+    for (int port = MAX_PORTS - 1; port >= 0; port--) {
+        pthread_mutex_unlock(&ctx->ports[port].lock);
+    }
+    return ok;
+}
+
+static bool oscBackendOpen(emstContext *ctx, int port, const char *endpointName)
+{
+    outputPort *output = &ctx->ports[port];
+    output->oscBuffer = malloc(OSC_MAX_DATAGRAM);
+    if ((output->oscBuffer == NULL) || !oscOpenSocket(ctx, port)) {
+        free(output->oscBuffer);
+        output->oscBuffer = NULL;
+        return false;
+    }
+    return true;
+}
+
+static size_t oscPutInt32(uint8_t *out, uint32_t value)
+{
+    out[0] = value >> 24;
+    out[1] = value >> 16;
+    out[2] = value >> 8;
+    out[3] = value;
+    return 4;
+}
+
+// OSC strings are 0-terminated and padded with 0s to a multiple of 4 bytes
+static size_t oscPutString(uint8_t *out, const char *string)
+{
+    size_t length = strlen(string);
+    size_t padded = (length + 4) & ~(size_t)3;
+    memcpy(out, string, length);
+    memset(out + length, 0, padded - length);
+    return padded;
+}
+
+// Starts a bundle: "#bundle", then the timetag (NTP format: seconds since 1900 and a 32 bit fraction)
+static size_t oscPutBundleHeader(uint8_t *out, const struct timespec *now)
+{
+    size_t length = oscPutString(out, "#bundle");
+    length += oscPutInt32(out + length, (uint32_t)(now->tv_sec + NTP_UNIX_OFFSET));
+    length += oscPutInt32(out + length, (uint32_t)(((uint64_t)now->tv_nsec << 32) / 1000000000));
+    return length;
+}
+
+// Writes one 3 byte MIDI message as a bundle element (a size followed by an OSC message).
+// Returns 0 for messages Emstrument doesn't send. ch is the context's channel number, 1-based.
+#define OSC_MAX_ELEMENT 64
+static size_t oscPutMessage(uint8_t *out, const uint8_t *msg, int ch)
+{
+    size_t length = 4; // the element's size goes first
+    switch (msg[0] & 0xF0) {
+        case 0x90:
+            length += oscPutString(out + length, OSC_ADDRESS_PREFIX "noteon");
+            length += oscPutString(out + length, ",iii");
+            break;
+        case 0x80:
+            length += oscPutString(out + length, OSC_ADDRESS_PREFIX "noteoff");
+            length += oscPutString(out + length, ",iii");
+            break;
+        case 0xB0:
+            length += oscPutString(out + length, OSC_ADDRESS_PREFIX "cc");
+            length += oscPutString(out + length, ",iii");
+            break;
+        case 0xE0:
+            length += oscPutString(out + length, OSC_ADDRESS_PREFIX "pitchbend");
+            length += oscPutString(out + length, ",ii");
+            break;
+        default:
+            return 0;
+    }
+    length += oscPutInt32(out + length, ch);
+    if ((msg[0] & 0xF0) == 0xE0) {
+        length += oscPutInt32(out + length, (msg[2] << 7) | msg[1]); // 14 bit value, 8192 is centered
+    } else {
+        length += oscPutInt32(out + length, msg[1]);
+        length += oscPutInt32(out + length, msg[2]);
+    }
+    oscPutInt32(out, length - 4);
+    return length;
 }
 
-static void sendResetNotes(int ch)
+static void oscBackendSend(emstContext *ctx, int port, const uint8_t *bytes, size_t length)
 {
-    Byte buffer[1024];
-    MIDIPacketList *packetlist = (MIDIPacketList *)buffer;
-    MIDIPacket *currentpacket = MIDIPacketListInit(packetlist);
-    for (int i = 0; i < 128; i++) {
-        // only turn off notes currently playing, to avoid message congestion
-        if (notePlaying[ch][i]) {
-            Byte msg[3] = {0x80 + ch, i, 0};
-            currentpacket = MIDIPacketListAdd(packetlist, sizeof(buffer), currentpacket, 0, 3, msg);
+    outputPort *output = &ctx->ports[port];
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    
+    size_t bundleLength = oscPutBundleHeader(output->oscBuffer, &now);
+    size_t headerLength = bundleLength;
+    for (size_t i = 0; i + 3 <= length; i += 3) {
+        if (bundleLength + OSC_MAX_ELEMENT > OSC_MAX_DATAGRAM) {
+            sendto(output->oscSocket, output->oscBuffer, bundleLength, 0,
+                   (const struct sockaddr *)&ctx->oscAddress, ctx->oscAddressLength);
+            bundleLength = headerLength; // same timetag
         }
+        bundleLength += oscPutMessage(&output->oscBuffer[bundleLength], &bytes[i],
+                                      port * 16 + (bytes[i] & 0x0F) + 1);
+    }
+    if (bundleLength > headerLength) {
+        sendto(output->oscSocket, output->oscBuffer, bundleLength, 0,
+               (const struct sockaddr *)&ctx->oscAddress, ctx->oscAddressLength);
     }
-    MIDIReceived(luaMIDIEndpoint, packetlist);
-    memset(&notePlaying[ch][0], 0, sizeof(bool) * 128);
 }
 
+static void oscBackendClose(emstContext *ctx, int port)
+{
+    outputPort *output = &ctx->ports[port];
+    close(output->oscSocket);
+    output->oscSocket = -1;
+    free(output->oscBuffer);
+    output->oscBuffer = NULL;
+}
+
+// Null backend: throws every batch away, for benchmarking everything up to the backend.
+static bool nullBackendOpen(emstContext *ctx, int port, const char *endpointName)
+{
+    return true;
+}
+
+static void nullBackendSend(emstContext *ctx, int port, const uint8_t *bytes, size_t length)
+{
+}
 
+static void nullBackendClose(emstContext *ctx, int port)
+{
+}
 
+// The first backend is the default one
+static const transportBackend kBackends[] = {
+#ifdef __APPLE__
+    {"coremidi", coreMIDIOpen, coreMIDISend, coreMIDIClose},
+#endif
+#ifdef EMSTRUMENT_ALSA
+    {"alsa", alsaOpen, alsaSend, alsaClose},
+#endif
+    {"ringbuffer", ringBackendOpen, ringBackendSend, ringBackendClose},
+    {"shm", shmBackendOpen, shmBackendSend, shmBackendClose},
+    {"osc", oscBackendOpen, oscBackendSend, oscBackendClose},
+    {"null", nullBackendOpen, nullBackendSend, nullBackendClose},
+    {NULL, NULL, NULL, NULL}
+};
 
+// Returns the default backend for NULL
+static const transportBackend *findBackend(const char *name)
+{
+    if (name == NULL) {
+        return &kBackends[0];
+    }
+    for (int i = 0; kBackends[i].name != NULL; i++) {
+        if (strcmp(kBackends[i].name, name) == 0) {
+            return &kBackends[i];
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,107 @@
+--[[
+    LuaJIT FFI bindings for Emstrument
+
+    Under LuaJIT, calling the module's Lua functions (MIDI.noteon() etc.) aborts the JIT
+    compiler's traces, so a hot loop that queues a lot of events every frame runs in the
+    interpreter. This file replaces the functions that queue events and MIDI.sendmessages()
+    with versions that call Emstrument's C API through the FFI, which compiled traces can call
+    directly. They take the same arguments and raise the same errors, but don't check the
+    number of arguments.
+
+    Usage: put this file next to emstrument.so, and load it instead of the module:
+    require('emstrument_ffi');
+    Everything else in the MIDI table stays the same. Under plain Lua 5.1 (no FFI) this only
+    loads the module, so scripts that use it still run everywhere.
+]]
+
+require('emstrument');
+
+local hasffi, ffi = pcall(require, 'ffi');
+if (not hasffi) then
+    return MIDI;
+end;
+
+-- Keep in sync with the C API declarations at the top of emstrument.c
+ffi.cdef[[
+int emst_noteon(int ch, int note, int vel);
+int emst_noteoff(int ch, int note);
+int emst_noteonwithduration(int ch, int note, int vel, int duration);
+int emst_cc(int ch, int cc, int value);
+int emst_pitchbend(int ch, double bend);
+int emst_allnotesoff(int ch);
+int emst_panic(void);
+int emst_flush(void);
+]]
+
+-- The module is already loaded, so this gets the same copy of it (and the same queue)
+local C = ffi.load(assert(package.searchpath('emstrument', package.cpath)));
+
+local EMST_NOT_INITIALIZED = -1;
+local EMST_QUEUE_FULL = -2;
+
+local function fail(result, name)
+    if (result == EMST_NOT_INITIALIZED) then
+        error("Must call MIDI.init() before MIDI."..name.."()", 3);
+    elseif (result == EMST_QUEUE_FULL) then
+        error("Not enough memory to queue MIDI command, call MIDI.sendmessages() more often", 3);
+    end;
+end;
+
+function MIDI.noteon(note, vel, ch)
+    local result = C.emst_noteon(ch or 1, note, vel);
+    if (result < 0) then
+        fail(result, "noteon");
+    end;
+end;
+
+function MIDI.noteoff(note, ch)
+    local result = C.emst_noteoff(ch or 1, note);
+    if (result < 0) then
+        fail(result, "noteoff");
+    end;
+end;
+
+function MIDI.noteonwithduration(note, vel, duration, ch)
+    local result = C.emst_noteonwithduration(ch or 1, note, vel, duration);
+    if (result < 0) then
+        fail(result, "noteonwithduration");
+    end;
+end;
+
+function MIDI.CC(cc, value, ch)
+    local result = C.emst_cc(ch or 1, cc, value);
+    if (result < 0) then
+        fail(result, "CC");
+    end;
+end;
+
+function MIDI.pitchbend(bend, ch)
+    local result = C.emst_pitchbend(ch or 1, bend);
+    if (result < 0) then
+        fail(result, "pitchbend");
+    end;
+end;
+
+function MIDI.allnotesoff(ch)
+    local result = C.emst_allnotesoff(ch or 1);
+    if (result < 0) then
+        fail(result, "allnotesoff");
+    end;
+end;
+
+function MIDI.panic()
+    local result = C.emst_panic();
+    if (result < 0) then
+        fail(result, "panic");
+    end;
+end;
+
+function MIDI.sendmessages()
+    local result = C.emst_flush();
+    if (result < 0) then
+        fail(result, "sendmessages");
+    end;
+    return result;
+end;
+
+return MIDI;
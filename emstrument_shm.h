@@ -0,0 +1,93 @@
+// Emstrument shared memory ring layout
+// The "shm" backend (see MIDI.init()) writes every batch of MIDI messages to a POSIX shared
+// memory object, so that another process (a bridge to JACK or ALSA, a recorder, etc.) can read
+// them without the emulator process making any system calls. tools/shm_consumer.c is a small
+// reference consumer. This header is the whole interface: it only needs C11 atomics.
+//
+// Each port gets its own object, named after the port with every character other than letters,
+// digits, '-' and '_' replaced by '_', and a leading '/', cut to 31 characters (OS X's limit):
+// "/EmstrumentMIDISource", "/EmstrumentMIDISource_2" etc. for the ports of MIDI.init().
+// Emstrument creates the object when the port is opened (replacing any leftover one) and
+// removes it when the port is closed, so consumers have to wait for it to appear.
+//
+// The object is an emstShmHeader followed by the data area, a ring of capacity bytes (a power
+// of 2). head and tail count every byte ever written and read, so the next record to read is at
+// offset tail & (capacity - 1) of the data area, and the ring is empty when head == tail. There
+// is one producer (Emstrument) and one consumer: the producer only writes head, and the consumer
+// only writes tail, each with a release store after the record is written or read (and an
+// acquire load of the other one), so no locks are needed.
+//
+// Every record starts on an 8 byte boundary with an emstShmRecord, followed by length bytes of
+// complete 3 byte MIDI messages (everything Emstrument sends in one go to that port), padded to
+// a multiple of 8. Records never wrap around the end of the data area: if a record doesn't fit
+// before the end, the producer writes EMST_SHM_WRAP in the length field at the current offset
+// and starts again at offset 0, so a record can always be read in place.
+//
+// If the consumer falls capacity bytes behind, new records are dropped (and counted in dropped)
+// instead of overwriting unread ones. When the port is closed, closed is set to 1; the consumer
+// can read what's left, and then has to wait for the object to be created again.
+
+#ifndef EMSTRUMENT_SHM_H
+#define EMSTRUMENT_SHM_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define EMST_SHM_MAGIC 0x314D485354534D45ull // "EMSTSHM1" in little-endian byte order
+#define EMST_SHM_VERSION 1
+#define EMST_SHM_NAME_MAX 32 // including the leading '/' and the terminating 0
+#define EMST_SHM_WRAP UINT32_MAX // in a record's length: the rest of the data area is unused
+
+typedef struct {
+    uint64_t magic; // EMST_SHM_MAGIC, written last when the object is set up
+    uint32_t version; // EMST_SHM_VERSION
+    uint32_t headerSize; // offset of the data area from the start of the object
+    uint64_t capacity; // size of the data area in bytes, a power of 2
+    _Atomic uint32_t closed; // set to 1 by the producer when the port is closed
+    _Alignas(64) _Atomic uint64_t head; // written by the producer
+    _Alignas(64) _Atomic uint64_t tail; // written by the consumer
+    _Alignas(64) _Atomic uint64_t dropped; // records the producer couldn't fit in the ring
+} emstShmHeader;
+
+typedef struct {
+    uint32_t length; // bytes of MIDI messages after this header, or EMST_SHM_WRAP
+    uint32_t reserved; // 0
+    // when the messages were sent, in ns: CLOCK_MONOTONIC on Linux, mach_absolute_time() (in ns)
+    // on OS X, or Emstrument's manual clock if the script uses MIDI.advanceclock()
+    uint64_t time;
+} emstShmRecord;
+
+// Bytes a record with length bytes of messages takes up in the ring
+#define EMST_SHM_RECORD_SIZE(length) (sizeof(emstShmRecord) + (((uint64_t)(length) + 7) & ~(uint64_t)7))
+
+static inline uint8_t *emstShmData(emstShmHeader *header)
+{
+    return (uint8_t *)header + header->headerSize;
+}
+
+// Consumer side. Returns the next record (its messages follow it), or NULL if the ring is empty.
+// The record stays valid until it's released with emstShmRelease().
+static inline const emstShmRecord *emstShmNext(emstShmHeader *header)
+{
+    uint64_t tail = atomic_load_explicit(&header->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&header->head, memory_order_acquire);
+    while (tail != head) {
+        uint64_t offset = tail & (header->capacity - 1);
+        const emstShmRecord *record = (const emstShmRecord *)(emstShmData(header) + offset);
+        if (record->length != EMST_SHM_WRAP) {
+            return record;
+        }
+        tail += header->capacity - offset;
+        atomic_store_explicit(&header->tail, tail, memory_order_release);
+    }
+    return NULL;
+}
+
+// Consumer side. Removes the record returned by emstShmNext() from the ring.
+static inline void emstShmRelease(emstShmHeader *header, const emstShmRecord *record)
+{
+    uint64_t tail = atomic_load_explicit(&header->tail, memory_order_relaxed);
+    atomic_store_explicit(&header->tail, tail + EMST_SHM_RECORD_SIZE(record->length), memory_order_release);
+}
+
+#endif
@@ -0,0 +1,88 @@
+--[[
+    Lookahead check for Emstrument
+
+    Plays short patterns in lookahead mode (see MIDI.configurelookahead()) with a lookahead
+    longer than the notes, on the manual clock (see MIDI.advanceclock()), and checks that the
+    note-on, note-off and panic messages come out in the order they would without lookahead.
+    Exits with status 1 if any pattern doesn't. Also checks that publishing more frames than
+    the lookahead ring holds, without moving the clock, doesn't wait forever.
+
+    Usage (from the directory containing emstrument.so):
+    lua tools/lookahead_check.lua
+]]
+
+require('emstrument');
+
+local frameMs = 1000 / 60;
+local failures = 0;
+
+-- Runs frames frames of play(frame) with the given lookahead, then lets everything still
+-- pending go out. Returns the output as a string of hex bytes.
+local function run(lookahead, frames, play)
+    MIDI.init("ringbuffer");
+    MIDI.advanceclock(0);
+    MIDI.configurelookahead(lookahead);
+    for frame = 1, frames do
+        play(frame);
+        MIDI.sendmessages();
+        MIDI.advanceclock(frameMs);
+    end;
+    MIDI.advanceclock(lookahead + 1000);
+    MIDI.configurelookahead(0);
+    local bytes = MIDI.drain();
+    local hex = {};
+    for i = 1, #bytes do
+        hex[i] = string.format("%02X", string.byte(bytes, i));
+    end;
+    return table.concat(hex, " ");
+end;
+
+-- The output with lookahead must be the same as without it
+local function check(name, frames, play)
+    local expected = run(0, frames, play);
+    local actual = run(20, frames, play);
+    if (actual ~= expected) then
+        io.stderr:write(name, ": expected\n    ", expected, "\ngot\n    ", actual, "\n");
+        failures = failures + 1;
+    end;
+end;
+
+-- a 16ms note every other frame: its note-off is due before the next one starts
+check("short notes", 12, function(frame)
+    if (frame % 2 == 1) then
+        MIDI.noteonwithduration(60, 100, 1);
+    end;
+end);
+
+-- a 3 frame note every other frame: retriggered while it's still playing
+check("retriggered notes", 12, function(frame)
+    if (frame % 2 == 1) then
+        MIDI.noteonwithduration(60, 100, 3);
+    end;
+end);
+
+-- a note without a duration, turned off by the panic of the next frame
+check("panic", 4, function(frame)
+    if (frame == 1) then
+        MIDI.noteon(64, 100);
+    elseif (frame == 2) then
+        MIDI.panic();
+    end;
+end);
+
+-- more frames than timedRing holds, without moving the manual clock: publishing them has to
+-- make room by moving the clock itself instead of waiting forever
+MIDI.init("ringbuffer");
+MIDI.advanceclock(0);
+MIDI.configurelookahead(20);
+for frame = 1, 50000 do
+    MIDI.noteon(60, 100);
+    MIDI.sendmessages();
+end;
+MIDI.configurelookahead(0);
+MIDI.drain();
+
+if (failures > 0) then
+    os.exit(1);
+end;
+print("lookahead check passed");
@@ -0,0 +1,59 @@
+--[[
+    RAM trace recorder for replay.lua
+    Script for FCEUX
+
+    Records the NES's RAM (0x0000-0x07FF) and both controllers every frame while you play,
+    and writes every change to trace.txt (in FCEUX's current directory), in the format
+    read by replay.lua. Stop the script to finish the trace.
+
+    Run this script on its own (FCEUX only runs one Lua script at a time), then replay the
+    trace with any Emstrument script for the same game.
+]]
+
+local output = assert(io.open("trace.txt", "w"));
+output:write("# RAM trace recorded with record_trace.lua\n");
+
+local buttonNames = {"A", "B", "select", "start", "up", "down", "left", "right"};
+
+local lastRam = {};
+local lastJoypads = {"", ""};
+local frame = 0;
+
+emu.registerexit(function()
+    output:close();
+end);
+
+while (true) do
+    frame = frame + 1;
+    local changes = {};
+
+    for address = 0, 0x07FF do
+        local value = memory.readbyte(address);
+        if (lastRam[address] ~= value) then
+            changes[#changes + 1] = string.format("%04X=%02X", address, value);
+            lastRam[address] = value;
+        end;
+    end;
+
+    for n = 1, 2 do
+        local buttons = joypad.read(n);
+        local pressed = {};
+        for i, name in ipairs(buttonNames) do
+            if (buttons[name]) then
+                pressed[#pressed + 1] = name;
+            end;
+        end;
+        local state = table.concat(pressed, "+");
+        if (state ~= lastJoypads[n]) then
+            changes[#changes + 1] = "joypad"..n.."="..state;
+            lastJoypads[n] = state;
+        end;
+    end;
+
+    if (#changes > 0) then
+        output:write(frame, " ", table.concat(changes, " "), "\n");
+    end;
+
+    gui.text(0, 8, "Recording RAM trace: frame "..frame);
+    FCEU.frameadvance();
+end;
@@ -0,0 +1,213 @@
+--[[
+    Replay harness for Emstrument scripts
+
+    Runs an Emstrument script without an emulator, as fast as possible, using a RAM trace
+    recorded with record_trace.lua instead of a running game. memory.readbyte(),
+    joypad.read() and FCEU.frameadvance()/emu.frameadvance() are replaced by stubs fed from
+    the trace, and gui functions do nothing. Emstrument's clock is driven by the harness
+    (see MIDI.advanceclock()), so the MIDI output is the same every time, which means the
+    output of two versions of Emstrument (or of a script) can be compared with diff.
+
+    Usage (from the directory containing emstrument.so):
+    lua tools/replay.lua [options] script.lua trace.txt
+
+    Options:
+    --output=file       write every MIDI message sent to file, one line per frame
+    --record=file       also record the output to a Standard MIDI File (see MIDI.record())
+    --backend=name      "ringbuffer" (default) or "null" (nothing is captured, for timing only)
+    --frames=n          stop after n frames (default: the end of the trace)
+    --framerate=fps     frames per second of the emulated game (default 60)
+
+    Trace format: one line per frame where something changed, everything else stays the same
+    as in the previous frame. Lines starting with # are comments.
+    <frame> [<address>=<value> ...] [joypad<n>=<button>+<button>...]
+    Frames start at 1, addresses and values are hexadecimal, e.g.
+    1 0037=14 0038=80 joypad1=A+right
+    2 0037=15 joypad1=
+]]
+
+local usage = "usage: lua tools/replay.lua [--output=file] [--record=file] [--backend=name] [--frames=n] [--framerate=fps] script.lua trace.txt";
+
+-- Parse arguments
+local options = {backend = "ringbuffer", framerate = 60};
+local paths = {};
+for i = 1, #arg do
+    local name, value = string.match(arg[i], "^%-%-(%w+)=(.*)$");
+    if (name ~= nil) then
+        options[name] = value;
+    else
+        paths[#paths + 1] = arg[i];
+    end;
+end;
+if (#paths ~= 2) then
+    io.stderr:write(usage, "\n");
+    os.exit(1);
+end;
+local scriptPath, tracePath = paths[1], paths[2];
+local framerate = tonumber(options.framerate);
+local frameLimit = tonumber(options.frames);
+
+-- Read the trace: trace[frame] = {ram = {[address] = value}, joypad = {[n] = buttons}}
+local trace = {};
+local lastFrame = 0;
+for line in io.lines(tracePath) do
+    local frame, rest = string.match(line, "^%s*(%d+)(.*)$");
+    if (frame ~= nil) then
+        frame = tonumber(frame);
+        local entry = {ram = {}, joypad = {}};
+        for token in string.gmatch(rest, "%S+") do
+            local address, value = string.match(token, "^(%x+)=(%x+)$");
+            local n, buttons = string.match(token, "^joypad(%d)=(.*)$");
+            if (address ~= nil) then
+                entry.ram[tonumber(address, 16)] = tonumber(value, 16);
+            elseif (n ~= nil) then
+                local pressed = {};
+                for button in string.gmatch(buttons, "[^+]+") do
+                    pressed[button] = true;
+                end;
+                entry.joypad[tonumber(n)] = pressed;
+            end;
+        end;
+        trace[frame] = entry;
+        if (frame > lastFrame) then
+            lastFrame = frame;
+        end;
+    end;
+end;
+if ((frameLimit ~= nil) and (frameLimit < lastFrame)) then
+    lastFrame = frameLimit;
+end;
+
+-- Emulator stubs
+local ram = {};
+local joypads = {{}, {}};
+local frameCount = 0;
+
+local function ignore()
+end;
+
+memory = {
+    readbyte = function(address)
+        return ram[address] or 0;
+    end,
+    writebyte = function(address, value)
+        ram[address] = value % 256;
+    end,
+};
+memory.readbytesigned = function(address)
+    local value = memory.readbyte(address);
+    return (value >= 128) and (value - 256) or value;
+end;
+
+joypad = {
+    read = function(n)
+        local buttons = {};
+        for button, pressed in pairs(joypads[n] or {}) do
+            buttons[button] = pressed;
+        end;
+        return buttons;
+    end,
+    set = ignore,
+};
+joypad.get = joypad.read;
+
+-- every gui function (gui.text(), gui.drawbox(), etc.) does nothing
+gui = setmetatable({}, {__index = function() return ignore; end});
+
+emu = {
+    frameadvance = coroutine.yield,
+    framecount = function() return frameCount; end,
+    message = ignore,
+};
+FCEU = emu;
+
+-- Load Emstrument with the capture backend before the script does, so its MIDI.init() call
+-- keeps using it
+require('emstrument');
+MIDI.init(options.backend);
+MIDI.advanceclock(0);
+if (options.record ~= nil) then
+    MIDI.record(options.record);
+end;
+
+math.randomseed(0);
+
+local script = assert(loadfile(scriptPath));
+local co = coroutine.create(script);
+
+local output = nil;
+if (options.output ~= nil) then
+    output = assert(io.open(options.output, "w"));
+end;
+
+local messages = 0;
+local function capture(frame)
+    if (options.backend ~= "ringbuffer") then
+        return;
+    end;
+    local bytes = MIDI.drain();
+    if (#bytes == 0) then
+        return;
+    end;
+    messages = messages + #bytes / 3;
+    if (output ~= nil) then
+        local hex = {};
+        for i = 1, #bytes do
+            hex[i] = string.format("%02X", string.byte(bytes, i));
+        end;
+        output:write(frame, ": ", table.concat(hex, " "), "\n");
+    end;
+end;
+
+-- Run the script one frame at a time
+local start = os.clock();
+for frame = 1, lastFrame do
+    frameCount = frame;
+    local entry = trace[frame];
+    if (entry ~= nil) then
+        for address, value in pairs(entry.ram) do
+            ram[address] = value;
+        end;
+        for n, buttons in pairs(entry.joypad) do
+            joypads[n] = buttons;
+        end;
+    end;
+
+    local ok, message = coroutine.resume(co);
+    if (not ok) then
+        io.stderr:write(scriptPath, ": frame ", frame, ": ", tostring(message), "\n");
+        os.exit(1);
+    end;
+
+    -- let note offs etc. that are due during this frame go out, then collect the output
+    MIDI.advanceclock(1000 / framerate);
+    capture(frame);
+
+    if (coroutine.status(co) == "dead") then
+        break;
+    end;
+end;
+local elapsed = os.clock() - start;
+
+-- turn off anything still playing, so the output ends in silence
+MIDI.panic();
+MIDI.sendmessages();
+capture(frameCount + 1);
+if (options.record ~= nil) then
+    MIDI.record(nil);
+end;
+if (output ~= nil) then
+    output:close();
+end;
+
+local stats = MIDI.stats();
+io.stderr:write(string.format("%d frames in %.3fs of CPU time (%.0f frames/s)\n", frameCount, elapsed,
+    frameCount / math.max(elapsed, 1e-9)));
+io.stderr:write(string.format("%d commands queued, %d deduped, %d messages sent by MIDI.sendmessages()\n",
+    stats.total.queued, stats.total.deduped, stats.total.sent));
+if (options.backend == "ringbuffer") then
+    io.stderr:write(string.format("%d messages captured (%.0f messages/s)\n", messages,
+        messages / math.max(elapsed, 1e-9)));
+end;
+io.stderr:write(string.format("MIDI.sendmessages(): %d us average, %d us max\n",
+    stats.total.avgflushtime, stats.total.maxflushtime));
@@ -0,0 +1,129 @@
+// Reference consumer for Emstrument's shared memory backend
+// Reads the MIDI messages a script sends with MIDI.init("shm") (or MIDI.open(name, "shm")) from
+// the port's shared memory ring, and prints one line per message: the time it was sent, in ms
+// since the first message, and its bytes. A bridge to JACK, ALSA or a recorder would do the same,
+// and hand the messages on instead of printing them. See emstrument_shm.h for the layout.
+//
+// Build with "make shmconsumer", run before or after starting the script:
+// tools/shm_consumer [port name]
+// The port name defaults to "EmstrumentMIDISource", the first port of MIDI.init(). When the port
+// is closed the consumer waits for it to be opened again; stop it with Ctrl-C.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../emstrument_shm.h"
+
+#define POLL_NS 1000000 // how long to sleep when the ring is empty
+
+static void nap(void)
+{
+    struct timespec poll = {0, POLL_NS};
+    nanosleep(&poll, NULL);
+}
+
+// Same as the backend's naming: '/' and the port's name, with anything unusual replaced by '_'
+static void objectName(char *name, const char *portName)
+{
+    size_t length = 0;
+    name[length++] = '/';
+    for (const char *c = portName; (*c != '\0') && (length < EMST_SHM_NAME_MAX - 1); c++) {
+        bool plain = ((*c >= 'a') && (*c <= 'z')) || ((*c >= 'A') && (*c <= 'Z')) ||
+                     ((*c >= '0') && (*c <= '9')) || (*c == '-') || (*c == '_');
+        name[length++] = plain ? *c : '_';
+    }
+    name[length] = '\0';
+}
+
+// Maps the object once Emstrument has created and set it up. Returns NULL if it isn't there yet.
+static emstShmHeader *attach(const char *name, size_t *size)
+{
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat info;
+    if ((fstat(fd, &info) != 0) || ((size_t)info.st_size < sizeof(emstShmHeader))) {
+        close(fd);
+        return NULL; // not set up yet
+    }
+    void *memory = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) {
+        return NULL;
+    }
+
+    emstShmHeader *header = memory;
+    bool ready = (header->magic == EMST_SHM_MAGIC);
+    atomic_thread_fence(memory_order_acquire);
+    if (!ready || (header->version != EMST_SHM_VERSION) ||
+        (header->headerSize + header->capacity > (uint64_t)info.st_size)) {
+        munmap(memory, info.st_size);
+        return NULL;
+    }
+    *size = info.st_size;
+    return header;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 2) {
+        fprintf(stderr, "usage: %s [port name]\n", argv[0]);
+        return 1;
+    }
+    char name[EMST_SHM_NAME_MAX];
+    objectName(name, (argc == 2) ? argv[1] : "EmstrumentMIDISource");
+
+    bool started = false;
+    uint64_t startTime = 0;
+    while (true) {
+        size_t size;
+        emstShmHeader *header = attach(name, &size);
+        if (header == NULL) {
+            nap();
+            continue;
+        }
+        fprintf(stderr, "reading %s\n", name);
+
+        uint64_t dropped = 0;
+        while (true) {
+            // read closed first, so nothing written before the port was closed is missed
+            bool closed = atomic_load_explicit(&header->closed, memory_order_acquire);
+            const emstShmRecord *record;
+            while ((record = emstShmNext(header)) != NULL) {
+                if (!started) {
+                    startTime = record->time;
+                    started = true;
+                }
+                const uint8_t *bytes = (const uint8_t *)(record + 1);
+                for (uint32_t i = 0; i + 3 <= record->length; i += 3) {
+                    printf("%12.3f  %02X %02X %02X\n", (double)(record->time - startTime) / 1e6,
+                           bytes[i], bytes[i + 1], bytes[i + 2]);
+                }
+                emstShmRelease(header, record);
+            }
+            fflush(stdout);
+
+            uint64_t newDropped = atomic_load_explicit(&header->dropped, memory_order_relaxed);
+            if (newDropped != dropped) {
+                fprintf(stderr, "%llu batches dropped\n", (unsigned long long)(newDropped - dropped));
+                dropped = newDropped;
+            }
+            if (closed) {
+                break;
+            }
+            nap();
+        }
+
+        fprintf(stderr, "%s closed\n", name);
+        munmap(header, size);
+    }
+    return 0;
+}